@@ -0,0 +1,269 @@
+/*
+ * Copyright (C) 2024 Bardia Moshiri <fakeshell@bardia.tech>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "loader.h"
+
+// Parse the tree at dir_path iterations times and report config throughput.
+void BenchParse(const std::string& dir_path, int iterations) {
+    size_t bytes = 0;
+    for (const char* cfg : {"modules.alias", "modules.dep", "modules.softdep", "modules.load",
+                            "modules.options", "modules.blocklist"}) {
+        struct stat fileStat {};
+        if (!stat((dir_path + "/" + cfg).c_str(), &fileStat)) {
+            bytes += fileStat.st_size;
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        Modprobe m({dir_path});
+        m.ParseAliases();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    double mb = static_cast<double>(bytes) * iterations / (1024 * 1024);
+    std::cout << "parse: " << mb << " MB in " << elapsed.count() * 1000 << " ms, "
+              << mb / elapsed.count() << " MB/s" << std::endl;
+}
+
+// Runs the kernel command line tokenizer over iterations random command
+// lines, checking that every option it returns is well formed, then reports
+// its throughput on a command line shaped like a real one.
+bool BenchCmdline(int iterations) {
+    std::mt19937 rng(iterations);
+    const std::string alphabet = "ab-_.=\" \t\n";
+    auto inside = [](std::string_view outer, std::string_view inner) {
+        return inner.data() >= outer.data() &&
+               inner.data() + inner.size() <= outer.data() + outer.size();
+    };
+    for (int i = 0; i < iterations; i++) {
+        std::string cmdline(rng() % 64, ' ');
+        for (auto& c : cmdline) c = alphabet[rng() % alphabet.size()];
+        CmdlineCursor cursor(cmdline);
+        CmdlineParam param;
+        while (cursor.Next(&param)) {
+            if (param.module.empty() || param.option.empty() ||
+                param.module.find('.') != std::string_view::npos ||
+                param.option.find('=') != std::string_view::npos || !inside(cmdline, param.module) ||
+                !inside(cmdline, param.option) || !inside(cmdline, param.value)) {
+                std::cout << "bad option " << param.module << "." << param.option << " in '"
+                          << cmdline << "'" << std::endl;
+                return false;
+            }
+        }
+    }
+
+    std::string cmdline;
+    for (int i = 0; cmdline.size() < 4096; i++) {
+        cmdline += "androidboot.param" + std::to_string(i) + "=value" + std::to_string(i) +
+                   " console=ttyMSM0,115200n8 quiet loglevel=3 ";
+        if (i % 8 == 0) {
+            cmdline += "module_" + std::to_string(i) + ".option=\"quoted value\" ";
+        }
+    }
+    cmdline += "-- init-arg\n";
+
+    size_t found = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        CmdlineCursor cursor(cmdline);
+        CmdlineParam param;
+        while (cursor.Next(&param)) found++;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    double mb = static_cast<double>(cmdline.size()) * iterations / (1024 * 1024);
+    std::cout << "cmdline: " << iterations << " fuzzed, " << found / iterations << " options in "
+              << cmdline.size() << " bytes, " << mb / elapsed.count() << " MB/s" << std::endl;
+    return true;
+}
+
+// Loads the tree at dir_path with simulated module loads once for every
+// thread count up to max_threads and reports the knee of the scaling curve:
+// the fewest threads that get within 10% of the best load time. A last run
+// with max_threads lets the adaptive load limit find its own concurrency.
+void BenchThreads(const std::string& dir_path, int max_threads, const WorkerConfig& workers) {
+    // Roughly what finit_module costs for a small module.
+    const int load_cost_us = 250;
+    std::vector<double> times;
+    for (int threads = 1; threads <= max_threads + 1; threads++) {
+        bool adaptive = threads > max_threads;
+        // The loader logs every module, keep that out of the report.
+        auto* log = std::cout.rdbuf(nullptr);
+        Modprobe m({dir_path});
+        m.SetWorkerConfig(workers);
+        m.SetSimulatedLoad(load_cost_us);
+        m.SetAdaptiveLoad(adaptive);
+        if (adaptive) threads = max_threads;
+        auto start = std::chrono::steady_clock::now();
+        bool ok = m.LoadModulesParallel(threads);
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        int loaded = m.GetModuleCount();
+        std::cout.rdbuf(log);
+        std::cout.clear();
+
+        if (!ok) {
+            std::cout << "threads=" << threads << " failed after " << loaded << " modules"
+                      << std::endl;
+            return;
+        }
+        if (!adaptive) times.emplace_back(elapsed.count());
+        std::cout << (adaptive ? "adaptive " : "") << "threads=" << threads
+                  << " modules=" << loaded << " load=" << elapsed.count()
+                  << "ms speedup=" << times.front() / elapsed.count() << std::endl;
+        if (adaptive) break;
+    }
+
+    double best = *std::min_element(times.begin(), times.end());
+    for (size_t i = 0; i < times.size(); i++) {
+        if (times[i] <= best * 1.1) {
+            std::cout << "knee: " << i + 1 << " threads" << std::endl;
+            break;
+        }
+    }
+}
+
+// Runs the boot load path on the module trees below base_dir, with module
+// loads simulated, and reports how long it took.
+bool BenchLoad(const std::string& base_dir, LoadOptions options) {
+    // Roughly what finit_module costs for a small module.
+    options.simulated_load_us = 250;
+    int loaded = 0;
+    auto start = std::chrono::steady_clock::now();
+    bool ok = LoadKernelModules(base_dir, loaded, options);
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "load: " << loaded << " modules in " << elapsed.count() << " ms with "
+              << options.jobs << " jobs" << std::endl;
+    return ok && loaded > 0;
+}
+
+void Usage(const char* argv0) {
+    std::cout << "Usage: " << argv0 << " -b|--bench-parse[=ITERATIONS] -d|--module-dir TREE"
+              << std::endl
+              << "       " << argv0 << " -c|--bench-cmdline[=ITERATIONS]" << std::endl
+              << "       " << argv0 << " -T|--bench-threads[=MAX_THREADS] -d|--module-dir TREE"
+              << " [-a|--cpus LIST] [-s|--sched POLICY[:PRIORITY]] [-N|--nice N]" << std::endl
+              << "       " << argv0 << " -L|--bench-load -d|--module-dir BASE_DIR [-j|--jobs N]"
+              << std::endl;
+}
+
+// Benchmarks and the command line fuzzer, built from the same sources as the
+// loader but kept out of the binary that runs at boot.
+int main(int argc, char** argv) {
+    std::string module_dir;
+    int bench_parse = 0;
+    int bench_cmdline = 0;
+    int bench_threads = 0;
+    bool bench_load = false;
+    LoadOptions load_options;
+    auto& workers = load_options.workers;
+    static const option long_options[] = {
+        {"module-dir", required_argument, nullptr, 'd'},
+        {"bench-parse", optional_argument, nullptr, 'b'},
+        {"bench-cmdline", optional_argument, nullptr, 'c'},
+        {"bench-threads", optional_argument, nullptr, 'T'},
+        {"bench-load", no_argument, nullptr, 'L'},
+        {"jobs", required_argument, nullptr, 'j'},
+        {"cpus", required_argument, nullptr, 'a'},
+        {"sched", required_argument, nullptr, 's'},
+        {"nice", required_argument, nullptr, 'N'},
+        {"help", no_argument, nullptr, 'h'},
+        {},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "d:b::c::T::Lj:a:s:N:h", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case 'd':
+                module_dir = optarg;
+                break;
+            case 'b':
+                bench_parse = optarg ? atoi(optarg) : 10;
+                if (bench_parse <= 0) {
+                    Usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'c':
+                bench_cmdline = optarg ? atoi(optarg) : 100000;
+                if (bench_cmdline <= 0) {
+                    Usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'T':
+                bench_threads = optarg ? atoi(optarg)
+                                       : 2 * std::max(1u, std::thread::hardware_concurrency());
+                if (bench_threads <= 0) {
+                    Usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'L':
+                bench_load = true;
+                break;
+            case 'j':
+                load_options.jobs = atoi(optarg);
+                if (load_options.jobs <= 0) {
+                    Usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'a':
+                if (!ParseCpuList(optarg, &workers.cpus)) {
+                    Usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 's':
+                if (!ParseSchedPolicy(optarg, &workers)) {
+                    Usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'N':
+                workers.nice = atoi(optarg);
+                if (workers.nice < -20 || workers.nice > 19) {
+                    Usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'h':
+                Usage(argv[0]);
+                return 0;
+            default:
+                Usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (bench_cmdline) {
+        return BenchCmdline(bench_cmdline) ? 0 : 1;
+    }
+    if (module_dir.empty() || !(bench_parse || bench_threads || bench_load)) {
+        Usage(argv[0]);
+        return 1;
+    }
+    if (bench_load && !BenchLoad(module_dir, load_options)) {
+        return 1;
+    }
+    if (bench_threads) {
+        BenchThreads(module_dir, bench_threads, workers);
+    }
+    if (bench_parse) {
+        BenchParse(module_dir, bench_parse);
+    }
+    return 0;
+}
@@ -0,0 +1,263 @@
+/*
+ * Copyright (C) 2024 Bardia Moshiri <fakeshell@bardia.tech>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kmod_index.h"
+
+#include <cstring>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr uint32_t kIndexMagic = 0xB007F457;
+constexpr uint32_t kIndexVersionMajor = 0x0002;
+// Magic, version and root offset.
+constexpr size_t kHeaderSize = 12;
+
+constexpr uint32_t kNodePrefix = 0x80000000;
+constexpr uint32_t kNodeValues = 0x40000000;
+constexpr uint32_t kNodeChilds = 0x20000000;
+constexpr uint32_t kNodeMask = 0x0FFFFFFF;
+
+uint32_t ReadBe32(const char* p) {
+    auto* bytes = reinterpret_cast<const unsigned char*>(p);
+    return uint32_t(bytes[0]) << 24 | uint32_t(bytes[1]) << 16 | uint32_t(bytes[2]) << 8 |
+           uint32_t(bytes[3]);
+}
+
+bool IsWildcard(char ch) {
+    return ch == '*' || ch == '?' || ch == '[';
+}
+
+}  // namespace
+
+struct KmodIndex::Node {
+    size_t pos = 0;
+    std::string_view prefix;
+    // No children unless first <= last.
+    unsigned char first = 1;
+    unsigned char last = 0;
+    // last - first + 1 big endian child offsets, zero where there is none.
+    const char* children = nullptr;
+    uint32_t num_values = 0;
+    size_t values_pos = 0;
+};
+
+KmodIndex::~KmodIndex() {
+    Close();
+}
+
+KmodIndex::KmodIndex(KmodIndex&& other) noexcept
+    : data_(other.data_), size_(other.size_), root_(other.root_) {
+    other.data_ = nullptr;
+}
+
+KmodIndex& KmodIndex::operator=(KmodIndex&& other) noexcept {
+    if (this != &other) {
+        Close();
+        data_ = other.data_;
+        size_ = other.size_;
+        root_ = other.root_;
+        other.data_ = nullptr;
+    }
+    return *this;
+}
+
+bool KmodIndex::Open(int dirfd, const std::string& name) {
+    Close();
+    int fd = TEMP_FAILURE_RETRY(openat(dirfd, name.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd == -1) {
+        return false;
+    }
+    struct stat st {};
+    void* data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= kHeaderSize) {
+        data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+
+    data_ = static_cast<const char*>(data);
+    size_ = st.st_size;
+    root_ = ReadBe32(data_ + 8);
+    Node root;
+    if (ReadBe32(data_) != kIndexMagic || ReadBe32(data_ + 4) >> 16 != kIndexVersionMajor ||
+        !ReadNode(root_, &root)) {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+void KmodIndex::Close() {
+    if (data_) {
+        munmap(const_cast<char*>(data_), size_);
+        data_ = nullptr;
+    }
+}
+
+// Every read is bounds checked, so a truncated or corrupt index only makes
+// lookups come up empty.
+bool KmodIndex::ReadNode(uint32_t offset, Node* node) const {
+    size_t pos = offset & kNodeMask;
+    if (pos < kHeaderSize || pos >= size_) {
+        return false;
+    }
+    *node = Node();
+    node->pos = pos;
+
+    if (offset & kNodePrefix) {
+        auto* end = static_cast<const char*>(memchr(data_ + pos, '\0', size_ - pos));
+        if (!end) return false;
+        node->prefix = std::string_view(data_ + pos, end - (data_ + pos));
+        pos += node->prefix.size() + 1;
+    }
+    if (offset & kNodeChilds) {
+        if (pos + 2 > size_) return false;
+        node->first = data_[pos];
+        node->last = data_[pos + 1];
+        pos += 2;
+        if (node->first > node->last) return false;
+        size_t count = node->last - node->first + 1;
+        if (pos + 4 * count > size_) return false;
+        node->children = data_ + pos;
+        pos += 4 * count;
+    }
+    if (offset & kNodeValues) {
+        if (pos + 4 > size_) return false;
+        node->num_values = ReadBe32(data_ + pos);
+        node->values_pos = pos + 4;
+    }
+    return true;
+}
+
+bool KmodIndex::ReadChild(const Node& node, unsigned char ch, Node* child) const {
+    if (!node.children || ch < node.first || ch > node.last) {
+        return false;
+    }
+    uint32_t offset = ReadBe32(node.children + 4 * (ch - node.first));
+    // depmod writes children before their parent, anything else would let
+    // a corrupt index loop.
+    if ((offset & kNodeMask) >= node.pos) {
+        return false;
+    }
+    return ReadNode(offset, child);
+}
+
+template <typename F>
+void KmodIndex::VisitValues(const Node& node, F&& f) const {
+    size_t pos = node.values_pos;
+    for (uint32_t i = 0; i < node.num_values; i++) {
+        // Each value is a priority followed by the string.
+        pos += 4;
+        if (pos >= size_) return;
+        auto* end = static_cast<const char*>(memchr(data_ + pos, '\0', size_ - pos));
+        if (!end) return;
+        f(std::string_view(data_ + pos, end - (data_ + pos)));
+        pos = end - data_ + 1;
+    }
+}
+
+void KmodIndex::AddValues(const Node& node, std::vector<std::string_view>* out) const {
+    VisitValues(node, [out](std::string_view value) { out->emplace_back(value); });
+}
+
+// Matches the rest of the trie below node, from prefix character skip on,
+// against key: pattern holds the key characters from the first wildcard
+// down to node, and every node with values completes a pattern to try.
+void KmodIndex::SearchWildcard(const Node& node, size_t skip, std::string* pattern, const char* key,
+                               std::vector<std::string_view>* out) const {
+    size_t pushed = node.prefix.size() - skip;
+    pattern->append(node.prefix.substr(skip));
+    Node child;
+    for (int ch = node.first; ch <= node.last; ch++) {
+        if (!ReadChild(node, ch, &child)) continue;
+        pattern->push_back(ch);
+        SearchWildcard(child, 0, pattern, key, out);
+        pattern->pop_back();
+    }
+    if (node.num_values && fnmatch(pattern->c_str(), key, 0) == 0) {
+        AddValues(node, out);
+    }
+    pattern->resize(pattern->size() - pushed);
+}
+
+// Follows key down the trie, branching off into SearchWildcard() wherever
+// the trie has a wildcard that key could match.
+std::vector<std::string_view> KmodIndex::LookupWildcard(std::string_view key) const {
+    std::vector<std::string_view> values;
+    Node node;
+    if (!IsOpen() || !ReadNode(root_, &node)) {
+        return values;
+    }
+    std::string key_str(key);
+    std::string pattern;
+    for (size_t i = 0;; i++) {
+        for (size_t j = 0; j < node.prefix.size(); j++) {
+            if (IsWildcard(node.prefix[j])) {
+                pattern.clear();
+                SearchWildcard(node, j, &pattern, key_str.c_str() + i + j, &values);
+                return values;
+            }
+            if (i + j == key.size() || node.prefix[j] != key[i + j]) {
+                return values;
+            }
+        }
+        i += node.prefix.size();
+
+        Node child;
+        for (char wildcard : {'*', '?', '['}) {
+            if (!ReadChild(node, wildcard, &child)) continue;
+            pattern.assign(1, wildcard);
+            SearchWildcard(child, 0, &pattern, key_str.c_str() + i, &values);
+        }
+        if (i == key.size()) {
+            AddValues(node, &values);
+            return values;
+        }
+        if (!ReadChild(node, key[i], &node)) {
+            return values;
+        }
+    }
+}
+
+void KmodIndex::Walk(const Node& node, std::string* key,
+                     const std::function<void(std::string_view, std::string_view)>& f) const {
+    size_t length = key->size();
+    key->append(node.prefix);
+    VisitValues(node, [&](std::string_view value) { f(*key, value); });
+    Node child;
+    for (int ch = node.first; ch <= node.last; ch++) {
+        if (!ReadChild(node, ch, &child)) continue;
+        key->push_back(ch);
+        Walk(child, key, f);
+        key->pop_back();
+    }
+    key->resize(length);
+}
+
+void KmodIndex::ForEach(const std::function<void(std::string_view, std::string_view)>& f) const {
+    Node root;
+    std::string key;
+    if (IsOpen() && ReadNode(root_, &root)) {
+        Walk(root, &key, f);
+    }
+}
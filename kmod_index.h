@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2024 Bardia Moshiri <fakeshell@bardia.tech>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Read-only view of one of the binary indexes depmod writes next to the
+// text files, modules.dep.bin and modules.alias.bin among them. The file is
+// a trie in kmod's index format version 2: big endian offsets whose top
+// bits say which parts a node has, path compressed by a prefix string per
+// node. The file is mapped, nothing is copied; returned views stay valid
+// until the index is closed.
+class KmodIndex {
+  public:
+    KmodIndex() = default;
+    ~KmodIndex();
+    KmodIndex(KmodIndex&& other) noexcept;
+    KmodIndex& operator=(KmodIndex&& other) noexcept;
+    KmodIndex(const KmodIndex&) = delete;
+    KmodIndex& operator=(const KmodIndex&) = delete;
+
+    // Maps name relative to dirfd. Returns false, leaving the index closed,
+    // if the file is missing or not an index this reader understands.
+    bool Open(int dirfd, const std::string& name);
+    void Close();
+    bool IsOpen() const { return data_ != nullptr; }
+
+    // Values of every key that, read as an fnmatch() pattern, matches key.
+    // Only the trie branches whose wildcards could match are visited.
+    std::vector<std::string_view> LookupWildcard(std::string_view key) const;
+    // Calls f with every key and value in the index, in key order.
+    void ForEach(const std::function<void(std::string_view, std::string_view)>& f) const;
+
+  private:
+    struct Node;
+
+    bool ReadNode(uint32_t offset, Node* node) const;
+    bool ReadChild(const Node& node, unsigned char ch, Node* child) const;
+    template <typename F>
+    void VisitValues(const Node& node, F&& f) const;
+    void AddValues(const Node& node, std::vector<std::string_view>* out) const;
+    void SearchWildcard(const Node& node, size_t skip, std::string* pattern, const char* key,
+                        std::vector<std::string_view>* out) const;
+    void Walk(const Node& node, std::string* key,
+              const std::function<void(std::string_view, std::string_view)>& f) const;
+
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    uint32_t root_ = 0;
+};
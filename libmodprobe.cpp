@@ -17,7 +17,7 @@
 
 #include "modprobe.h"
 
-std::vector<std::string> SplitString(const std::string& str, const std::string& delimiters = " \n") {
+std::vector<std::string> SplitString(const std::string& str, const std::string& delimiters) {
     std::vector<std::string> result;
     std::string token;
 
@@ -50,19 +50,115 @@ std::string JoinStrings(const std::set<std::string>& strings, const std::string&
     return joinedString.str();
 }
 
+std::string JsonEscape(const std::string& str) {
+    std::string escaped;
+    for (char ch : str) {
+        switch (ch) {
+            case '"':
+                escaped += "\\\"";
+                break;
+            case '\\':
+                escaped += "\\\\";
+                break;
+            case '\n':
+                escaped += "\\n";
+                break;
+            case '\t':
+                escaped += "\\t";
+                break;
+            default:
+                if (static_cast<unsigned char>(ch) < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", ch);
+                    escaped += buf;
+                } else {
+                    escaped += ch;
+                }
+        }
+    }
+    return escaped;
+}
+
 std::string Basename(const std::string& pathname) {
     size_t pos = pathname.find_last_of("/\\");
     return (pos == std::string::npos) ? pathname : pathname.substr(pos + 1);
 }
 
-bool EndsWith(const std::string& str, const std::string& suffix) {
+bool EndsWith(std::string_view str, std::string_view suffix) {
     if (str.length() < suffix.length()) {
         return false;
     }
     return str.compare(str.length() - suffix.length(), suffix.length(), suffix) == 0;
 }
 
-std::string Modprobe::MakeCanonical(const std::string& module_path) {
+bool TokenCursor::Next(std::string_view* token) {
+    while (pos_ < line_.size() && line_[pos_] == ' ') pos_++;
+    if (pos_ == line_.size()) {
+        return false;
+    }
+    auto end = line_.find(' ', pos_);
+    if (end == std::string_view::npos) end = line_.size();
+    *token = line_.substr(pos_, end - pos_);
+    pos_ = end;
+    return true;
+}
+
+size_t TokenCursor::Count() const {
+    TokenCursor counter(line_);
+    std::string_view token;
+    size_t count = 0;
+    while (counter.Next(&token)) count++;
+    return count;
+}
+
+bool CmdlineCursor::Next(CmdlineParam* param) {
+    auto is_space = [](char c) { return isspace(static_cast<unsigned char>(c)) != 0; };
+    while (pos_ < cmdline_.size()) {
+        while (pos_ < cmdline_.size() && is_space(cmdline_[pos_])) pos_++;
+        if (pos_ == cmdline_.size()) {
+            break;
+        }
+
+        bool quoted = cmdline_[pos_] == '"';
+        if (quoted) pos_++;
+        size_t start = pos_;
+        size_t equals = std::string_view::npos;
+        bool in_quotes = quoted;
+        for (; pos_ < cmdline_.size(); pos_++) {
+            char c = cmdline_[pos_];
+            if (c == '=' && equals == std::string_view::npos) {
+                equals = pos_;
+            } else if (c == '"') {
+                in_quotes = !in_quotes;
+            } else if (!in_quotes && is_space(c)) {
+                break;
+            }
+        }
+        size_t end = pos_;
+        if (quoted && end > start && cmdline_[end - 1] == '"') end--;
+
+        if (!quoted && cmdline_.substr(start, end - start) == "--") {
+            pos_ = cmdline_.size();
+            break;
+        }
+        if (equals == std::string_view::npos || equals >= end) {
+            continue;
+        }
+        auto name = cmdline_.substr(start, equals - start);
+        auto dot = name.find('.');
+        if (dot == std::string_view::npos || dot == 0 || dot + 1 == name.size()) {
+            continue;
+        }
+        param->module = name.substr(0, dot);
+        param->option = name.substr(dot + 1);
+        param->value = cmdline_.substr(equals + 1, end - equals - 1);
+        param->quoted = quoted;
+        return true;
+    }
+    return false;
+}
+
+std::string Modprobe::MakeCanonical(std::string_view module_path) {
     auto start = module_path.find_last_of('/');
     if (start == std::string::npos) {
         start = 0;
@@ -77,87 +173,77 @@ std::string Modprobe::MakeCanonical(const std::string& module_path) {
         std::cout << "malformed module name: " << module_path << std::endl;
         return "";
     }
-    std::string module_name = module_path.substr(start, end - start);
+    std::string module_name(module_path.substr(start, end - start));
     // module names can have '-', but their file names will have '_'
     std::replace(module_name.begin(), module_name.end(), '-', '_');
     return module_name;
 }
 
-bool Modprobe::ParseDepCallback(const std::string& base_path,
-                                const std::vector<std::string>& args) {
+bool Modprobe::ParseDepCallback(int base_index, TokenCursor& args) {
     std::vector<std::string> deps;
-    std::string prefix = "";
+    std::string_view token;
+    args.Next(&token);
 
     // Set first item as our modules path
-    std::string::size_type pos = args[0].find(':');
-    if (args[0][0] != '/') {
-        prefix = base_path + "/";
-    }
+    std::string::size_type pos = token.find(':');
     if (pos != std::string::npos) {
-        deps.emplace_back(prefix + args[0].substr(0, pos));
+        deps.emplace_back(token.substr(0, pos));
     } else {
         std::cout << "dependency lines must start with name followed by ':'" << std::endl;
         return false;
     }
 
     // Remaining items are dependencies of our module
-    for (auto arg = args.begin() + 1; arg != args.end(); ++arg) {
-        if ((*arg)[0] != '/') {
-            prefix = base_path + "/";
-        } else {
-            prefix = "";
-        }
-        deps.push_back(prefix + *arg);
+    while (args.Next(&token)) {
+        deps.emplace_back(token);
     }
 
-    std::string canonical_name = MakeCanonical(args[0].substr(0, pos));
+    std::string canonical_name = MakeCanonical(deps[0]);
     if (canonical_name.empty()) {
         return false;
     }
-    this->module_deps_[canonical_name] = deps;
+    this->module_base_[canonical_name] = base_index;
+    this->module_deps_[std::move(canonical_name)] = std::move(deps);
 
     return true;
 }
 
-bool Modprobe::ParseAliasCallback(const std::vector<std::string>& args) {
-    auto it = args.begin();
-    const std::string& type = *it++;
+bool Modprobe::ParseAliasCallback(TokenCursor& args) {
+    std::string_view type, alias, module_name, extra;
+    args.Next(&type);
 
     if (type != "alias") {
         std::cout << "non-alias line encountered in modules.alias, found " << type << std::endl;
         return false;
     }
 
-    if (args.size() != 3) {
-        std::cout << "alias lines in modules.alias must have 3 entries, not " << args.size() << std::endl;
+    if (!args.Next(&alias) || !args.Next(&module_name) || args.Next(&extra)) {
+        std::cout << "alias lines in modules.alias must have 3 entries, not " << args.Count() << std::endl;
         return false;
     }
 
-    const std::string& alias = *it++;
-    const std::string& module_name = *it++;
     this->module_aliases_.emplace_back(alias, module_name);
 
     return true;
 }
 
-bool Modprobe::ParseSoftdepCallback(const std::vector<std::string>& args) {
-    auto it = args.begin();
-    const std::string& type = *it++;
-    std::string state = "";
+bool Modprobe::ParseSoftdepCallback(TokenCursor& args) {
+    std::string_view type, module, token;
+    std::string_view state = "";
+    args.Next(&type);
 
     if (type != "softdep") {
         std::cout << "non-softdep line encountered in modules.softdep, found " << type << std::endl;
         return false;
     }
 
-    if (args.size() < 4) {
+    if (args.Count() < 4) {
         std::cout << "softdep lines in modules.softdep must have at least 4 entries" << std::endl;
         return false;
     }
 
-    const std::string& module = *it++;
-    while (it != args.end()) {
-        const std::string& token = *it++;
+    args.Next(&module);
+    while (args.Next(&token)) {
         if (token == "pre:" || token == "post:") {
             state = token;
             continue;
@@ -176,49 +262,48 @@ bool Modprobe::ParseSoftdepCallback(const std::vector<std::string>& args) {
     return true;
 }
 
-bool Modprobe::ParseLoadCallback(const std::vector<std::string>& args) {
-    auto it = args.begin();
-    const std::string& module = *it++;
+bool Modprobe::ParseLoadCallback(TokenCursor& args) {
+    std::string_view module;
+    args.Next(&module);
 
-    const std::string& canonical_name = MakeCanonical(module);
+    std::string canonical_name = MakeCanonical(module);
     if (canonical_name.empty()) {
         return false;
     }
-    this->module_load_.emplace_back(canonical_name);
+    this->module_load_.emplace_back(std::move(canonical_name));
 
     return true;
 }
 
-bool Modprobe::ParseOptionsCallback(const std::vector<std::string>& args) {
-    auto it = args.begin();
-    const std::string& type = *it++;
+bool Modprobe::ParseOptionsCallback(TokenCursor& args) {
+    std::string_view type, module, token;
+    args.Next(&type);
 
     if (type != "options") {
         std::cout << "non-options line encountered in modules.options" << std::endl;
         return false;
     }
 
-    if (args.size() < 2) {
-        std::cout << "lines in modules.options must have at least 2 entries, not " << args.size() << std::endl;
+    if (!args.Next(&module)) {
+        std::cout << "lines in modules.options must have at least 2 entries, not " << args.Count() << std::endl;
         return false;
     }
 
-    const std::string& module = *it++;
     std::string options = "";
 
-    const std::string& canonical_name = MakeCanonical(module);
+    std::string canonical_name = MakeCanonical(module);
     if (canonical_name.empty()) {
         return false;
     }
 
-    while (it != args.end()) {
-        options += *it++;
-        if (it != args.end()) {
+    while (args.Next(&token)) {
+        if (!options.empty()) {
             options += " ";
         }
+        options += token;
     }
 
-    auto [unused, inserted] = this->module_options_.emplace(canonical_name, options);
+    auto [unused, inserted] = this->module_options_.emplace(std::move(canonical_name), options);
     if (!inserted) {
         std::cout << "multiple options lines present for module " << module << std::endl;
         return false;
@@ -226,72 +311,69 @@ bool Modprobe::ParseOptionsCallback(const std::vector<std::string>& args) {
     return true;
 }
 
-bool Modprobe::ParseBlocklistCallback(const std::vector<std::string>& args) {
-    auto it = args.begin();
-    const std::string& type = *it++;
+bool Modprobe::ParseBlocklistCallback(TokenCursor& args) {
+    std::string_view type, module, extra;
+    args.Next(&type);
 
     if (type != "blocklist") {
         std::cout << "non-blocklist line encountered in modules.blocklist" << std::endl;
         return false;
     }
 
-    if (args.size() != 2) {
-        std::cout << "lines in modules.blocklist must have exactly 2 entries, not " << args.size() << std::endl;
+    if (!args.Next(&module) || args.Next(&extra)) {
+        std::cout << "lines in modules.blocklist must have exactly 2 entries, not " << args.Count() << std::endl;
         return false;
     }
 
-    const std::string& module = *it++;
-
-    const std::string& canonical_name = MakeCanonical(module);
+    std::string canonical_name = MakeCanonical(module);
     if (canonical_name.empty()) {
         return false;
     }
-    this->module_blocklist_.emplace(canonical_name);
+    this->module_blocklist_.emplace(std::move(canonical_name));
 
     return true;
 }
 
-bool ReadFileToString(const std::string& filePath, std::string* outString) {
-    std::ifstream fileStream(filePath);
-    if (!fileStream) {
+bool Modprobe::ParseBuiltinCallback(TokenCursor& args) {
+    std::string_view path, extra;
+    args.Next(&path);
+
+    if (args.Next(&extra)) {
+        std::cout << "lines in modules.builtin must have exactly 1 entry, not " << args.Count() << std::endl;
+        return false;
+    }
+
+    std::string canonical_name = MakeCanonical(path);
+    if (canonical_name.empty()) {
         return false;
     }
+    this->module_builtin_.emplace(std::move(canonical_name));
 
-    std::stringstream buffer;
-    buffer << fileStream.rdbuf();
-    *outString = buffer.str();
     return true;
 }
 
-void Modprobe::ParseCfg(const std::string& cfg,
-                        std::function<bool(const std::vector<std::string>&)> f) {
-    std::string cfg_contents;
-    if (!ReadFileToString(cfg, &cfg_contents)) {
-        return;
+bool ReadFileAt(int dirfd, const std::string& filePath, std::string* outString) {
+    int fd = TEMP_FAILURE_RETRY(openat(dirfd, filePath.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd == -1) {
+        return false;
     }
 
-    std::vector<std::string> lines = SplitString(cfg_contents, "\n");
-    for (const auto& line : lines) {
-        if (line.empty() || line[0] == '#') {
-            continue;
-        }
-        const std::vector<std::string> args = SplitString(line, " ");
-        if (args.empty()) continue;
-        f(args);
+    struct stat fileStat {};
+    outString->clear();
+    if (!fstat(fd, &fileStat) && fileStat.st_size > 0) {
+        outString->reserve(fileStat.st_size);
     }
-    return;
+    char buffer[16384];
+    ssize_t n;
+    while ((n = TEMP_FAILURE_RETRY(read(fd, buffer, sizeof(buffer)))) > 0) {
+        outString->append(buffer, n);
+    }
+    close(fd);
+    return n == 0;
 }
 
-void Modprobe::AddOption(const std::string& module_name, const std::string& option_name,
-                         const std::string& value) {
-    auto canonical_name = MakeCanonical(module_name);
-    auto options_iter = module_options_.find(canonical_name);
-    auto option_str = option_name + "=" + value;
-    if (options_iter != module_options_.end()) {
-        options_iter->second = options_iter->second + " " + option_str;
-    } else {
-        module_options_.emplace(canonical_name, option_str);
-    }
+bool ReadFileToString(const std::string& filePath, std::string* outString) {
+    return ReadFileAt(AT_FDCWD, filePath, outString);
 }
 
 std::string Modprobe::GetKernelCmdline(void) {
@@ -303,93 +385,332 @@ std::string Modprobe::GetKernelCmdline(void) {
 }
 
 void Modprobe::ParseKernelCmdlineOptions(void) {
-    std::string cmdline = GetKernelCmdline();
-    std::string module_name = "";
-    std::string option_name = "";
-    std::string value = "";
-    bool in_module = true;
-    bool in_option = false;
-    bool in_value = false;
-    bool in_quotes = false;
-    int start = 0;
-
-    for (int i = 0; i < cmdline.size(); i++) {
-        if (cmdline[i] == '"') {
-            in_quotes = !in_quotes;
-        }
-
-        if (in_quotes) continue;
-
-        if (cmdline[i] == ' ') {
-            if (in_value) {
-                value = cmdline.substr(start, i - start);
-                if (!module_name.empty() && !option_name.empty()) {
-                    AddOption(module_name, option_name, value);
-                }
-            }
-            module_name = "";
-            option_name = "";
-            value = "";
-            in_value = false;
-            start = i + 1;
-            in_module = true;
+    // The command line is the same for every tree we look at, read it once.
+    static const std::string cmdline = GetKernelCmdline();
+    std::string canonical_name;
+    CmdlineCursor cursor(cmdline);
+    CmdlineParam param;
+    while (cursor.Next(&param)) {
+        canonical_name.assign(param.module);
+        std::replace(canonical_name.begin(), canonical_name.end(), '-', '_');
+        // Most of the command line is for the kernel itself or for modules
+        // this tree does not have, none of that is worth a table entry.
+        if (module_deps_.find(canonical_name) == module_deps_.end()) {
             continue;
         }
+        auto& options = module_options_[canonical_name];
+        if (!options.empty()) {
+            options += ' ';
+        }
+        options.append(param.option).append(1, '=');
+        if (param.quoted) {
+            options.append(1, '"').append(param.value).append(1, '"');
+        } else {
+            options.append(param.value);
+        }
+    }
+}
 
-        if (cmdline[i] == '.') {
-            if (in_module) {
-                module_name = cmdline.substr(start, i - start);
-                start = i + 1;
-                in_module = false;
-            }
-            in_option = true;
+template <typename Handler>
+void Modprobe::ParseCfg(int base_index, const std::string& cfg, Handler&& f) {
+    PhaseTimer::Scope timer("parse:", base_paths_[base_index] + "/" + cfg);
+    std::string cfg_contents;
+    if (!ReadFileAt(base_fds_[base_index], cfg, &cfg_contents)) {
+        return;
+    }
+
+    std::string_view contents(cfg_contents);
+    std::string_view token;
+    while (!contents.empty()) {
+        auto end = contents.find('\n');
+        if (end == std::string_view::npos) end = contents.size();
+        std::string_view line = contents.substr(0, end);
+        contents.remove_prefix(std::min(end + 1, contents.size()));
+
+        if (line.empty() || line[0] == '#') {
             continue;
         }
+        TokenCursor args(line);
+        if (!TokenCursor(line).Next(&token)) continue;
+        f(args);
+    }
+    return;
+}
+
+std::string Modprobe::CfgFileName(CfgFile file) {
+    switch (file) {
+        case kCfgAlias:
+            return "modules.alias";
+        case kCfgDep:
+            return "modules.dep";
+        case kCfgSoftdep:
+            return "modules.softdep";
+        case kCfgLoad:
+            return load_file_;
+        case kCfgOptions:
+            return "modules.options";
+        case kCfgBlocklist:
+            return "modules.blocklist";
+        case kCfgBuiltin:
+        default:
+            return "modules.builtin";
+    }
+}
 
-        if (cmdline[i] == '=') {
-            if (in_option) {
-                option_name = cmdline.substr(start, i - start);
-                start = i + 1;
-                in_option = false;
+// The file a table is read from in the tree at base_index: depmod's binary
+// index where the tree has one, the text file otherwise.
+std::string Modprobe::CfgSourceName(int base_index, CfgFile file) {
+    const char* index = nullptr;
+    if (file == kCfgDep) {
+        index = "modules.dep.bin";
+    } else if (file == kCfgAlias) {
+        index = "modules.alias.bin";
+    } else if (file == kCfgBuiltin) {
+        index = "modules.builtin.bin";
+    }
+    if (index && faccessat(base_fds_[base_index], index, F_OK, 0) == 0) {
+        return index;
+    }
+    return CfgFileName(file);
+}
+
+namespace {
+
+// Drops the entries table gained from index first on that it already held,
+// keeping the first of each.
+template <typename T>
+void DropRepeated(std::vector<T>& table, size_t first) {
+    std::set<T> seen(table.begin(), table.begin() + first);
+    table.erase(std::remove_if(table.begin() + first, table.end(),
+                               [&](const T& entry) { return !seen.insert(entry).second; }),
+                table.end());
+}
+
+}  // namespace
+
+// Several base paths make one merged index, each later path overlaying the
+// ones before it: a module's modules.dep line and options line come from the
+// last path that has one, while load lists, aliases and softdeps are joined
+// with the entries that trees share kept once.
+void Modprobe::ParseCfgFile(int base_index, CfgFile file) {
+    auto cfg = CfgSourceName(base_index, file);
+    if (cfg != CfgFileName(file)) {
+        if (ParseCfgIndex(base_index, file, cfg)) return;
+        cfg = CfgFileName(file);
+    }
+
+    // One ParseCfg instantiation per format, each inlining its callback.
+    switch (file) {
+        case kCfgAlias: {
+            size_t first = module_aliases_.size();
+            ParseCfg(base_index, cfg, [this](TokenCursor& args) { return ParseAliasCallback(args); });
+            if (base_index > 0) DropRepeated(module_aliases_, first);
+            break;
+        }
+        case kCfgDep:
+            ParseCfg(base_index, cfg, [this, base_index](TokenCursor& args) {
+                return ParseDepCallback(base_index, args);
+            });
+            break;
+        case kCfgSoftdep: {
+            size_t first_pre = module_pre_softdep_.size();
+            size_t first_post = module_post_softdep_.size();
+            ParseCfg(base_index, cfg, [this](TokenCursor& args) { return ParseSoftdepCallback(args); });
+            if (base_index > 0) {
+                DropRepeated(module_pre_softdep_, first_pre);
+                DropRepeated(module_post_softdep_, first_post);
             }
-            in_value = true;
-            continue;
+            break;
         }
-    }
-    if (in_value && !in_quotes) {
-        value = cmdline.substr(start, cmdline.size() - start);
-        if (!module_name.empty() && !option_name.empty()) {
-            AddOption(module_name, option_name, value);
+        case kCfgLoad: {
+            size_t first = module_load_.size();
+            ParseCfg(base_index, cfg, [this](TokenCursor& args) { return ParseLoadCallback(args); });
+            if (base_index > 0) DropRepeated(module_load_, first);
+            break;
         }
+        case kCfgOptions: {
+            // Parsed on its own so repeated lines within the file are still
+            // reported, then earlier trees fill in the modules it skips.
+            auto earlier = std::move(module_options_);
+            module_options_.clear();
+            ParseCfg(base_index, cfg, [this](TokenCursor& args) { return ParseOptionsCallback(args); });
+            module_options_.merge(earlier);
+            break;
+        }
+        case kCfgBlocklist:
+            ParseCfg(base_index, cfg,
+                     [this](TokenCursor& args) { return ParseBlocklistCallback(args); });
+            break;
+        case kCfgBuiltin:
+        default:
+            ParseCfg(base_index, cfg, [this](TokenCursor& args) { return ParseBuiltinCallback(args); });
+            break;
     }
 }
 
+// Reads a table from depmod's binary index instead of its text file.
+// Returns false if the index is unusable and the text file has to do.
+bool Modprobe::ParseCfgIndex(int base_index, CfgFile file, const std::string& name) {
+    PhaseTimer::Scope timer("parse:", base_paths_[base_index] + "/" + name);
+    KmodIndex index;
+    if (!index.Open(base_fds_[base_index], name)) {
+        std::cout << "Ignoring unreadable index " << base_paths_[base_index] << "/" << name
+                  << std::endl;
+        return false;
+    }
+    if (file == kCfgAlias) {
+        // Searched in place by FindAliases(), nothing is copied out.
+        alias_indexes_[base_index] = std::move(index);
+        return true;
+    }
+    if (file == kCfgBuiltin) {
+        // Keyed by module name, the values are empty.
+        index.ForEach([this](std::string_view module, std::string_view) {
+            module_builtin_.emplace(module);
+        });
+        return true;
+    }
+    // The module index needs every module up front, so the dep index is
+    // walked once. Its values are modules.dep lines, keyed by module name.
+    index.ForEach([this, base_index](std::string_view, std::string_view line) {
+        TokenCursor args(line);
+        ParseDepCallback(base_index, args);
+    });
+    return true;
+}
+
 Modprobe::Modprobe(const std::vector<std::string>& base_paths, const std::string load_file,
                    bool use_blocklist)
-    : blocklist_enabled(use_blocklist) {
-    using namespace std::placeholders;
-
+    : load_file_(load_file), blocklist_enabled(use_blocklist) {
     for (const auto& base_path : base_paths) {
-        auto alias_callback = std::bind(&Modprobe::ParseAliasCallback, this, _1);
-        ParseCfg(base_path + "/modules.alias", alias_callback);
+        int base_index = base_paths_.size();
+        base_paths_.emplace_back(base_path);
+        base_fds_.emplace_back(TEMP_FAILURE_RETRY(
+                open(base_path.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC)));
+        alias_indexes_.emplace_back();
+        if (base_fds_.back() == -1) {
+            continue;
+        }
+
+        // modules.alias is usually the largest file and most boots never
+        // look at it, see ParseAliases().
+        for (int file = kCfgAlias + 1; file < kNumCfgFiles; file++) {
+            ParseCfgFile(base_index, static_cast<CfgFile>(file));
+        }
+    }
+
+    {
+        PhaseTimer::Scope timer("parse:cmdline");
+        ParseKernelCmdlineOptions();
+    }
+    BuildModuleIndex();
+}
+
+void Modprobe::BuildModuleIndex() {
+    module_ids_.clear();
+    module_ids_.reserve(module_deps_.size());
+    module_names_.clear();
+    for (const auto& [module, deps] : module_deps_) {
+        auto it = module_ids_.emplace(module, module_ids_.size()).first;
+        module_names_.emplace_back(&it->first);
+    }
+    for (const auto& module : module_builtin_) {
+        auto [it, inserted] = module_ids_.emplace(module, module_ids_.size());
+        if (inserted) module_names_.emplace_back(&it->first);
+    }
+    module_dep_ids_.assign(module_ids_.size(), {});
+    for (const auto& [module, deps] : module_deps_) {
+        auto& dep_ids = module_dep_ids_[module_ids_[module]];
+        for (auto dep = deps.begin() + std::min<size_t>(1, deps.size()); dep != deps.end(); ++dep) {
+            int dep_id = GetModuleId(MakeCanonical(*dep));
+            // -1 marks a dep without its own modules.dep line.
+            dep_ids.emplace_back(dep_id);
+        }
+    }
+    module_state_.reset(new std::atomic<ModuleState>[module_ids_.size()]);
+    module_fds_.reset(new std::atomic<int>[module_ids_.size()]);
+    for (size_t id = 0; id < module_ids_.size(); id++) {
+        module_state_[id] = ModuleState::kUnloaded;
+        module_fds_[id] = -1;
+    }
+    for (const auto& module : module_builtin_) {
+        module_state_[module_ids_[module]] = ModuleState::kLoaded;
+    }
+    BuildDependencyClosures();
+    BuildBlocklistIndex();
+}
 
-        auto dep_callback = std::bind(&Modprobe::ParseDepCallback, this, base_path, _1);
-        ParseCfg(base_path + "/modules.dep", dep_callback);
+const ModuleBitset& Modprobe::GetClosure(int id) {
+    auto& closure = module_closure_[id];
+    if (!closure.Empty()) return closure;
+
+    // Set before recursing so a dependency cycle terminates.
+    closure = ModuleBitset(module_ids_.size());
+    ModuleBitset deps(module_ids_.size());
+    for (int dep_id : module_dep_ids_[id]) {
+        if (dep_id < 0 || deps.Test(dep_id)) continue;
+        deps.Set(dep_id);
+        deps |= GetClosure(dep_id);
+    }
+    closure = std::move(deps);
+    return closure;
+}
 
-        auto softdep_callback = std::bind(&Modprobe::ParseSoftdepCallback, this, _1);
-        ParseCfg(base_path + "/modules.softdep", softdep_callback);
+// Transitive hard dependencies of every listed module as bitsets over module
+// IDs, so what a set of modules needs is the OR of their closures.
+void Modprobe::BuildDependencyClosures() {
+    module_closure_.assign(module_ids_.size(), {});
+    for (const auto& module : module_load_) {
+        int id = GetModuleId(module);
+        if (id >= 0) GetClosure(id);
+    }
+}
 
-        auto load_callback = std::bind(&Modprobe::ParseLoadCallback, this, _1);
-        ParseCfg(base_path + "/" + load_file, load_callback);
+Modprobe::~Modprobe() {
+    for (size_t id = 0; id < module_ids_.size(); id++) {
+        CloseModuleFd(id);
+    }
+    for (int fd : base_fds_) {
+        if (fd != -1) close(fd);
+    }
+}
 
-        auto options_callback = std::bind(&Modprobe::ParseOptionsCallback, this, _1);
-        ParseCfg(base_path + "/modules.options", options_callback);
+int Modprobe::GetBaseFd(const std::string& canonical_name) {
+    auto it = module_base_.find(canonical_name);
+    if (it == module_base_.end()) {
+        return AT_FDCWD;
+    }
+    return base_fds_[it->second];
+}
 
-        auto blocklist_callback = std::bind(&Modprobe::ParseBlocklistCallback, this, _1);
-        ParseCfg(base_path + "/modules.blocklist", blocklist_callback);
+int Modprobe::GetModuleId(const std::string& canonical_name) {
+    auto it = module_ids_.find(canonical_name);
+    if (it == module_ids_.end()) {
+        return -1;
     }
+    return it->second;
+}
+
+bool Modprobe::IsLoaded(const std::string& canonical_name) {
+    int id = GetModuleId(canonical_name);
+    return id >= 0 && module_state_[id] == ModuleState::kLoaded;
+}
+
+void Modprobe::SetModuleState(int id, ModuleState state) {
+    module_state_[id] = state;
+    if (load_waiters_ > 0) {
+        // Taking the lock orders this store against a waiter's predicate check.
+        { std::lock_guard guard(load_wait_lock_); }
+        load_wait_cv_.notify_all();
+    }
+}
 
-    ParseKernelCmdlineOptions();
+ModuleState Modprobe::WaitForModule(int id) {
+    load_waiters_++;
+    std::unique_lock lk(load_wait_lock_);
+    load_wait_cv_.wait(lk, [&] { return module_state_[id] != ModuleState::kLoading; });
+    load_waiters_--;
+    return module_state_[id];
 }
 
 std::vector<std::string> Modprobe::GetDependencies(const std::string& module) {
@@ -406,6 +727,10 @@ bool Modprobe::InsmodWithDeps(const std::string& module_name, const std::string&
         return false;
     }
 
+    if (IsBuiltin(module_name)) {
+        return true;
+    }
+
     auto dependencies = GetDependencies(module_name);
     if (dependencies.empty()) {
         std::cout << "Module " << module_name << " not in dependency file" << std::endl;
@@ -444,10 +769,35 @@ bool Modprobe::InsmodWithDeps(const std::string& module_name, const std::string&
     return true;
 }
 
+void Modprobe::ParseAliases() {
+    std::call_once(aliases_once_, [this] {
+        for (size_t base_index = 0; base_index < base_paths_.size(); base_index++) {
+            if (base_fds_[base_index] == -1) continue;
+            ParseCfgFile(base_index, kCfgAlias);
+        }
+    });
+}
+
+// Modules with an alias matching name, from modules.alias or its index.
+std::vector<std::string> Modprobe::FindAliases(const std::string& name) {
+    ParseAliases();
+    std::vector<std::string> modules;
+    for (const auto& [alias, aliased_module] : module_aliases_) {
+        if (fnmatch(alias.c_str(), name.c_str(), 0) == 0) modules.emplace_back(aliased_module);
+    }
+    // depmod stores aliases with '-' turned into '_', as kmod looks them up.
+    std::string normalized = name;
+    std::replace(normalized.begin(), normalized.end(), '-', '_');
+    for (const auto& index : alias_indexes_) {
+        for (auto module : index.LookupWildcard(normalized)) modules.emplace_back(module);
+    }
+    return modules;
+}
+
 bool Modprobe::LoadWithAliases(const std::string& module_name, bool strict,
                                const std::string& parameters) {
     auto canonical_name = MakeCanonical(module_name);
-    if (module_loaded_.count(canonical_name)) {
+    if (IsLoaded(canonical_name)) {
         return true;
     }
 
@@ -455,12 +805,14 @@ bool Modprobe::LoadWithAliases(const std::string& module_name, bool strict,
     bool module_loaded = false;
 
     // use aliases to expand list of modules to load (multiple modules
-    // may alias themselves to the requested name)
-    for (const auto& [alias, aliased_module] : module_aliases_) {
-        if (fnmatch(alias.c_str(), module_name.c_str(), 0) != 0) continue;
-        std::cout << "Found alias for '" << module_name << "': '" << aliased_module;
-        if (module_loaded_.count(MakeCanonical(aliased_module))) continue;
-        modules_to_load.emplace(aliased_module);
+    // may alias themselves to the requested name), a name with its own
+    // modules.dep line is loaded as is
+    if (GetModuleId(canonical_name) < 0) {
+        for (const auto& aliased_module : FindAliases(module_name)) {
+            std::cout << "Found alias for '" << module_name << "': '" << aliased_module;
+            if (IsLoaded(MakeCanonical(aliased_module))) continue;
+            modules_to_load.emplace(aliased_module);
+        }
     }
 
     // attempt to load all modules aliased to this name
@@ -477,138 +829,982 @@ bool Modprobe::LoadWithAliases(const std::string& module_name, bool strict,
     return true;
 }
 
+void BloomFilter::Build(const std::unordered_set<std::string>& keys) {
+    // Around 16 bits per key, at least one word.
+    size_t words = 1;
+    while (words * 64 < keys.size() * 16) words *= 2;
+    bits_.assign(words, 0);
+    mask_ = words * 64 - 1;
+    for (const auto& key : keys) {
+        size_t hash = std::hash<std::string>()(key);
+        size_t first = hash & mask_, second = (hash >> 32) & mask_;
+        bits_[first / 64] |= 1ULL << (first % 64);
+        bits_[second / 64] |= 1ULL << (second % 64);
+    }
+}
+
+bool BloomFilter::MayContain(const std::string& key) const {
+    if (bits_.empty()) return false;
+    size_t hash = std::hash<std::string>()(key);
+    size_t first = hash & mask_, second = (hash >> 32) & mask_;
+    return (bits_[first / 64] >> (first % 64) & 1) && (bits_[second / 64] >> (second % 64) & 1);
+}
+
+// Resolve the blocklist against modules.dep once: a module counts as
+// blocklisted when it or any of its hard deps is, so IsBlocklisted() is a
+// single lookup by module ID.
+void Modprobe::BuildBlocklistIndex() {
+    module_blocklist_filter_.Build(module_blocklist_);
+    module_blocked_ = ModuleBitset(module_ids_.size());
+    if (module_blocklist_.empty()) return;
+
+    ModuleBitset blocklist(module_ids_.size());
+    for (const auto& module : module_blocklist_) {
+        int id = GetModuleId(module);
+        if (id >= 0) blocklist.Set(id);
+    }
+    for (size_t id = 0; id < module_ids_.size(); id++) {
+        bool blocked = blocklist.Test(id);
+        if (!module_closure_[id].Empty()) {
+            blocked = blocked || module_closure_[id].Intersects(blocklist);
+        } else {
+            for (int dep_id : module_dep_ids_[id]) {
+                if (dep_id >= 0 && blocklist.Test(dep_id)) {
+                    blocked = true;
+                    break;
+                }
+            }
+        }
+        if (blocked) module_blocked_.Set(id);
+    }
+}
+
+bool Modprobe::IsBuiltin(const std::string& canonical_name) {
+    return module_builtin_.count(canonical_name) > 0;
+}
+
 bool Modprobe::IsBlocklisted(const std::string& module_name) {
     if (!blocklist_enabled) return false;
 
+    // Names from modules.load and modules.dep lookups are usually canonical
+    // already, only canonicalize when the direct lookup misses.
+    int id = GetModuleId(module_name);
+    if (id >= 0) return module_blocked_.Test(id);
+
     auto canonical_name = MakeCanonical(module_name);
-    auto dependencies = GetDependencies(canonical_name);
-    for (auto dep = dependencies.begin(); dep != dependencies.end(); ++dep) {
-        if (module_blocklist_.count(MakeCanonical(*dep))) return true;
+    id = GetModuleId(canonical_name);
+    if (id >= 0) return module_blocked_.Test(id);
+
+    return module_blocklist_filter_.MayContain(canonical_name) &&
+           module_blocklist_.count(canonical_name) > 0;
+}
+
+namespace {
+
+// Per-worker queue for the parallel loader. The owning worker pushes and pops
+// at the back so freshly unblocked dependents run next on the same core, idle
+// workers steal from the front where the oldest (coldest) work sits.
+class WorkDeque {
+  public:
+    void PushBack(int id) {
+        std::lock_guard guard(lock_);
+        items_.push_back(id);
+    }
+
+    bool PopBack(int* id) {
+        std::lock_guard guard(lock_);
+        if (items_.empty()) return false;
+        *id = items_.back();
+        items_.pop_back();
+        return true;
+    }
+
+    bool StealFront(int* id) {
+        std::lock_guard guard(lock_);
+        if (items_.empty()) return false;
+        *id = items_.front();
+        items_.pop_front();
+        return true;
     }
 
-    return module_blocklist_.count(canonical_name) > 0;
+  private:
+    std::mutex lock_;
+    std::deque<int> items_;
+};
+
+// Applies config to the calling thread. Failures leave the thread as it was,
+// only the first worker reports them.
+void ApplyWorkerConfig(const WorkerConfig& config, bool report) {
+    if (!config.cpus.empty()) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : config.cpus) CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) && report) {
+            std::cout << "Failed to set loader CPU affinity: " << strerror(errno) << std::endl;
+        }
+    }
+    if (config.policy != SCHED_OTHER) {
+        sched_param param {};
+        param.sched_priority = config.priority;
+        if (sched_setscheduler(0, config.policy, &param) && report) {
+            std::cout << "Failed to set loader scheduler policy: " << strerror(errno) << std::endl;
+        }
+    }
+    if (config.nice != 0) {
+        if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), config.nice) && report) {
+            std::cout << "Failed to set loader nice level: " << strerror(errno) << std::endl;
+        }
+    }
 }
 
-// Another option to load kernel modules. load independent modules dependencies
-// in parallel and then update dependency list of other remaining modules,
-// repeat these steps until all modules are loaded.
-// Discard all blocklist.
-// Softdeps are taken care in InsmodWithDeps().
-bool Modprobe::LoadModulesParallel(int num_threads) {
+// Runs task(id) for every node of a dependency graph on num_threads workers,
+// each owning a deque of ready nodes. A node becomes ready once all
+// pending_deps[id] nodes it waits on are done; dependents[id] lists the nodes
+// waiting on id. A worker that finishes a node pushes the nodes it unblocked
+// onto its own deque, and steals from the others when it runs dry. Workers
+// run with config applied. A failed task only stops the nodes waiting on it,
+// directly or not; everything else still runs. If blame is given, blame[id]
+// ends up as id for a failed node, as the failed node for a node skipped
+// because of it, and -1 otherwise. Returns false if any task failed.
+bool RunDependencyGraph(const std::vector<std::vector<int>>& dependents,
+                        const std::vector<int>& pending_deps, int num_threads,
+                        const WorkerConfig& config, std::vector<int>* blame,
+                        const std::function<bool(int)>& task) {
+    const size_t num_nodes = pending_deps.size();
+    if (num_nodes == 0) return true;
+
+    num_threads = std::max(num_threads, 1);
+    std::vector<WorkDeque> deques(num_threads);
+    std::unique_ptr<std::atomic<int>[]> remaining_deps(new std::atomic<int>[num_nodes]);
+    std::atomic<int> queued = 0;
+    for (size_t id = 0, next = 0; id < num_nodes; id++) {
+        remaining_deps[id] = pending_deps[id];
+        if (pending_deps[id] == 0) {
+            deques[next++ % num_threads].PushBack(id);
+            queued++;
+        }
+    }
+
+    std::atomic<int> remaining = num_nodes;
+    std::atomic<bool> ret = true;
+    std::mutex idle_lock;
+    std::condition_variable idle_cv;
+    std::unique_ptr<std::atomic<int>[]> failed_by(new std::atomic<int>[num_nodes]);
+    for (size_t id = 0; id < num_nodes; id++) failed_by[id] = -1;
+
+    // The nodes behind a failed one can never become ready. Claim each for
+    // the failure, once even where failures share dependents, and count
+    // them as done so the workers still finish.
+    auto poison = [&](int failed) {
+        int count = 1;
+        failed_by[failed] = failed;
+        std::vector<int> stack = {failed};
+        while (!stack.empty()) {
+            int id = stack.back();
+            stack.pop_back();
+            for (int dependent : dependents[id]) {
+                int unclaimed = -1;
+                if (failed_by[dependent].compare_exchange_strong(unclaimed, failed)) {
+                    count++;
+                    stack.emplace_back(dependent);
+                }
+            }
+        }
+        return count;
+    };
+
+    auto done = [&] { return remaining == 0; };
+    auto wake = [&](bool all) {
+        std::lock_guard guard(idle_lock);
+        if (all) {
+            idle_cv.notify_all();
+        } else {
+            idle_cv.notify_one();
+        }
+    };
+
+    auto thread_function = [&](int self) {
+        ApplyWorkerConfig(config, self == 0);
+        while (!done()) {
+            int id = -1;
+            bool found = deques[self].PopBack(&id);
+            for (int i = 1; !found && i < num_threads; i++) {
+                found = deques[(self + i) % num_threads].StealFront(&id);
+            }
+            if (!found) {
+                std::unique_lock lk(idle_lock);
+                idle_cv.wait(lk, [&] { return queued > 0 || done(); });
+                continue;
+            }
+            queued--;
+
+            if (!task(id)) {
+                ret = false;
+                if ((remaining -= poison(id)) == 0) wake(true);
+                continue;
+            }
+
+            for (int dependent : dependents[id]) {
+                if (--remaining_deps[dependent] == 0) {
+                    deques[self].PushBack(dependent);
+                    queued++;
+                    wake(false);
+                }
+            }
+            if (--remaining == 0) wake(true);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < num_threads; i++) {
+        threads.emplace_back(thread_function, i);
+    }
+
+    // Wait for the threads.
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    if (blame) {
+        blame->resize(num_nodes);
+        for (size_t id = 0; id < num_nodes; id++) (*blame)[id] = failed_by[id];
+    }
+    return ret;
+}
+
+// Prints every node whose task failed with the nodes skipped because of it,
+// from the blame filled in by RunDependencyGraph().
+void ReportGraphFailures(const std::string& prefix, const std::vector<int>& blame,
+                         const std::function<const std::string&(int)>& name) {
+    std::map<int, std::vector<int>> skipped;
+    size_t num_skipped = 0;
+    for (size_t id = 0; id < blame.size(); id++) {
+        if (blame[id] < 0) continue;
+        auto& nodes = skipped[blame[id]];
+        if (blame[id] != static_cast<int>(id)) {
+            nodes.emplace_back(id);
+            num_skipped++;
+        }
+    }
+    if (skipped.empty()) return;
+
+    std::cout << prefix << skipped.size() << " failed, " << num_skipped
+              << " skipped because of them" << std::endl;
+    for (const auto& [failed, nodes] : skipped) {
+        std::cout << prefix << "  " << name(failed) << " failed";
+        if (!nodes.empty()) {
+            std::cout << ", skipped:";
+            for (int id : nodes) std::cout << " " << name(id);
+        }
+        std::cout << std::endl;
+    }
+}
+
+// Fills in the dependents of every node of plan from its deps, then the
+// levels and the critical path. Join nodes are no load step of their own.
+void FinishLoadPlan(LoadPlan* plan) {
+    auto& nodes = plan->modules;
+    std::vector<int> pending(nodes.size());
+    std::vector<int> ready;
+    for (size_t id = 0; id < nodes.size(); id++) {
+        for (int dep : nodes[id].deps) nodes[dep].dependents.emplace_back(id);
+        pending[id] = nodes[id].deps.size();
+        if (pending[id] == 0) ready.emplace_back(id);
+    }
+    while (!ready.empty()) {
+        int id = ready.back();
+        ready.pop_back();
+        int steps = nodes[id].level + (nodes[id].join ? 0 : 1);
+        plan->critical_path = std::max(plan->critical_path, steps);
+        for (int dependent : nodes[id].dependents) {
+            nodes[dependent].level = std::max(nodes[dependent].level, steps);
+            if (--pending[dependent] == 0) ready.emplace_back(dependent);
+        }
+    }
+}
+
+}  // namespace
+
+// Modules that cannot be loaded stay in the plan with an error, so only
+// they and what needs them fail. Returns false if there is any such module.
+bool Modprobe::BuildLoadPlan(LoadPlan* plan) {
+    *plan = LoadPlan();
+    auto& nodes = plan->modules;
+    std::vector<int> node_ids(module_ids_.size(), -1);
+    std::unordered_map<std::string, int> missing_ids;
+    ModuleBitset needed(module_ids_.size());
     bool ret = true;
-    std::unordered_map<std::string, std::vector<std::string>> mod_with_deps;
+
+    auto add_node = [&](int module_id) {
+        if (node_ids[module_id] < 0) {
+            node_ids[module_id] = nodes.size();
+            nodes.emplace_back();
+            nodes.back().name = *module_names_[module_id];
+            nodes.back().sequential = IsLoadSequential(nodes.back().name);
+        }
+        return node_ids[module_id];
+    };
+    // A name without a modules.dep line, once however many need it.
+    auto add_missing = [&](const std::string& name) {
+        auto [it, inserted] = missing_ids.emplace(name, nodes.size());
+        if (inserted) {
+            nodes.emplace_back();
+            nodes.back().name = name;
+            nodes.back().error = "Hard-dep: Module " + name + " not in .dep file";
+            ret = false;
+        }
+        return it->second;
+    };
 
     // Get dependencies
     for (const auto& module : module_load_) {
         // Skip blocklist modules
         if (IsBlocklisted(module)) {
-            std::cout << "LMP: Blocklist: Module " << module << " skipping..." << std::endl;
+            plan->blocklisted.emplace_back(module);
             continue;
         }
-        auto dependencies = GetDependencies(MakeCanonical(module));
-        if (dependencies.empty()) {
-            std::cout << "LMP: Hard-dep: Module " << module
-                       << " not in .dep file" << std::endl;
-            return false;
+        if (IsBuiltin(MakeCanonical(module))) {
+            plan->builtin.emplace_back(module);
+            continue;
+        }
+        int module_id = GetModuleId(MakeCanonical(module));
+        if (module_id < 0) {
+            nodes[add_missing(module)].listed = true;
+            continue;
         }
-        mod_with_deps[MakeCanonical(module)] = dependencies;
+        nodes[add_node(module_id)].listed = true;
+        needed.Set(module_id);
+        needed |= GetClosure(module_id);
     }
 
-    while (!mod_with_deps.empty()) {
-        std::vector<std::thread> threads;
-        std::vector<std::string> mods_path_to_load;
-        std::mutex vector_lock;
-
-        // Find independent modules
-        for (const auto& [it_mod, it_dep] : mod_with_deps) {
-            auto itd_last = it_dep.rbegin();
-            if (itd_last == it_dep.rend())
+    // Everything the listed modules need, listed modules first.
+    needed.ForEach(add_node);
+
+    // Hard dependency edges.
+    for (size_t id = 0; id < nodes.size(); id++) {
+        int module_id = GetModuleId(nodes[id].name);
+        if (module_id < 0) continue;
+        for (size_t i = 0; i < module_dep_ids_[module_id].size(); i++) {
+            int dep_module_id = module_dep_ids_[module_id][i];
+            if (dep_module_id < 0) {
+                int dep_id = add_missing(MakeCanonical(module_deps_[nodes[id].name][i + 1]));
+                nodes[id].deps.emplace_back(dep_id);
                 continue;
-
-            auto cnd_last = MakeCanonical(*itd_last);
+            }
+            int dep_id = node_ids[dep_module_id];
             // Hard-dependencies cannot be blocklisted
-            if (IsBlocklisted(cnd_last)) {
-                std::cout << "LMP: Blocklist: Module-dep " << cnd_last
-                           << " : failed to load module " << it_mod << std::endl;
-                return false;
+            if (blocklist_enabled && module_blocked_.Test(dep_module_id) &&
+                nodes[dep_id].error.empty()) {
+                nodes[dep_id].error = "Blocklist: Module-dep " + nodes[dep_id].name +
+                                      " is blocklisted";
+                ret = false;
             }
+            nodes[id].deps.emplace_back(dep_id);
+        }
+    }
+
+    FinishLoadPlan(plan);
+    return ret;
+}
 
-            if (module_options_[cnd_last].find("load_sequential=1") != std::string::npos) {
-                if (!LoadWithAliases(cnd_last, true)) {
-                    return false;
+// The listed names and the hard deps of those that are modules, in list
+// order; names that are not modules (aliases, blocklisted modules) are
+// leaves left to LoadWithAliases(). A listed name that brings in a
+// load_sequential=1 module, itself or as a dep, waits for a join node on
+// everything added before it, and everything added after it waits for it.
+// As in BuildLoadPlan(), names that resolve to nothing and hard deps
+// without a modules.dep line are nodes with an error, and make it return
+// false.
+bool Modprobe::BuildListedLoadPlan(LoadPlan* plan) {
+    *plan = LoadPlan();
+    auto& nodes = plan->modules;
+    // Module ID of each node, -1 for leaves and joins.
+    std::vector<int> node_modules;
+    std::vector<int> node_ids(module_ids_.size(), -1);
+    std::unordered_map<std::string, int> leaf_ids;
+    // The last barrier, which every node added after it waits for, and the
+    // nodes added since.
+    int barrier = -1;
+    std::vector<int> since_barrier;
+    bool ret = true;
+
+    auto add_node = [&](const std::string& name, int module_id) {
+        nodes.emplace_back();
+        nodes.back().name = name;
+        node_modules.emplace_back(module_id);
+        if (module_id >= 0) {
+            node_ids[module_id] = nodes.size() - 1;
+            nodes.back().sequential = IsLoadSequential(name);
+        }
+        return static_cast<int>(nodes.size() - 1);
+    };
+
+    for (const auto& module : module_load_) {
+        if (IsBuiltin(module)) {
+            plan->builtin.emplace_back(module);
+            continue;
+        }
+        int module_id = GetModuleId(module);
+        std::vector<int> added;
+        if (module_id < 0 || IsBlocklisted(module)) {
+            auto [it, inserted] = leaf_ids.emplace(module, nodes.size());
+            if (inserted) {
+                added.emplace_back(add_node(module, -1));
+                if (IsBlocklisted(module)) {
+                    plan->blocklisted.emplace_back(module);
+                } else if (module_id < 0 && FindAliases(module).empty()) {
+                    nodes.back().error = "Module " + module + " not in .dep file or modules.alias";
+                    ret = false;
                 }
-            } else {
-                if (std::find(mods_path_to_load.begin(), mods_path_to_load.end(),
-                            cnd_last) == mods_path_to_load.end()) {
-                    mods_path_to_load.emplace_back(cnd_last);
+            }
+            nodes[it->second].listed = true;
+        } else if (node_ids[module_id] < 0) {
+            // The module and whatever of its hard deps is not in yet.
+            std::vector<int> pending = {module_id};
+            added.emplace_back(add_node(module, module_id));
+            while (!pending.empty()) {
+                int id = pending.back();
+                pending.pop_back();
+                for (int dep : module_dep_ids_[id]) {
+                    if (dep < 0 || node_ids[dep] >= 0) continue;
+                    added.emplace_back(add_node(*module_names_[dep], dep));
+                    pending.emplace_back(dep);
                 }
             }
         }
+        if (module_id >= 0 && node_ids[module_id] >= 0) {
+            nodes[node_ids[module_id]].listed = true;
+        }
 
-        // Load independent modules in parallel
-        auto thread_function = [&] {
-            std::unique_lock lk(vector_lock);
-            while (!mods_path_to_load.empty()) {
-                auto ret_load = true;
-                auto mod_to_load = std::move(mods_path_to_load.back());
-                mods_path_to_load.pop_back();
+        bool sequential = false;
+        for (int id : added) sequential |= nodes[id].sequential;
+        if (sequential) {
+            int join = add_node("", -1);
+            nodes[join].join = true;
+            nodes[join].deps = since_barrier;
+            if (barrier >= 0) nodes[join].deps.emplace_back(barrier);
+            for (int id : added) nodes[id].deps.emplace_back(join);
+            barrier = added.front();
+            since_barrier.clear();
+            continue;
+        }
+        for (int id : added) {
+            if (barrier >= 0) nodes[id].deps.emplace_back(barrier);
+            since_barrier.emplace_back(id);
+        }
+    }
 
-                lk.unlock();
-                ret_load &= LoadWithAliases(mod_to_load, true);
-                lk.lock();
-                if (!ret_load) {
-                    ret &= ret_load;
-                }
+    // Hard dependency edges, a dep without a modules.dep line gets a node
+    // of its own, once however many need it.
+    std::unordered_map<std::string, int> missing_ids;
+    for (size_t id = 0; id < nodes.size(); id++) {
+        if (node_modules[id] < 0) continue;
+        const auto& module_dep_ids = module_dep_ids_[node_modules[id]];
+        for (size_t i = 0; i < module_dep_ids.size(); i++) {
+            if (module_dep_ids[i] >= 0) {
+                nodes[id].deps.emplace_back(node_ids[module_dep_ids[i]]);
+                continue;
+            }
+            auto name = MakeCanonical(module_deps_[nodes[id].name][i + 1]);
+            auto [it, inserted] = missing_ids.emplace(name, nodes.size());
+            if (inserted) {
+                add_node(name, -1);
+                nodes.back().error = "Hard-dep: Module " + name + " not in .dep file";
+                ret = false;
             }
-        };
+            nodes[id].deps.emplace_back(it->second);
+        }
+    }
+
+    FinishLoadPlan(plan);
+    return ret;
+}
 
-        std::generate_n(std::back_inserter(threads), num_threads,
-                        [&] { return std::thread(thread_function); });
+static void WriteJsonList(std::ostream& out, const std::vector<std::string>& items) {
+    out << "[";
+    for (auto it = items.begin(); it != items.end(); ++it) {
+        if (it != items.begin()) out << ",";
+        out << "\"" << JsonEscape(*it) << "\"";
+    }
+    out << "]";
+}
 
-        // Wait for the threads.
-        for (auto& thread : threads) {
-            thread.join();
+bool Modprobe::WriteLoadPlan(std::ostream& out, bool listed) {
+    LoadPlan plan;
+    bool ret = listed ? BuildListedLoadPlan(&plan) : BuildLoadPlan(&plan);
+    // Join nodes have no name of their own, '@' cannot start a module's.
+    auto name = [&](int id) {
+        const auto& module = plan.modules[id];
+        return module.join ? "@join" + std::to_string(id) : module.name;
+    };
+
+    out << "{\"ok\":" << (ret ? "true" : "false")
+        << ",\"scheduler\":\"" << (listed ? "listed" : "parallel") << "\"";
+    out << ",\"module_count\":" << plan.modules.size()
+        << ",\"critical_path\":" << plan.critical_path << ",\"blocklisted\":";
+    WriteJsonList(out, plan.blocklisted);
+    out << ",\"builtin\":";
+    WriteJsonList(out, plan.builtin);
+    out << ",\"modules\":[";
+    for (size_t id = 0; id < plan.modules.size(); id++) {
+        const auto& module = plan.modules[id];
+        std::vector<std::string> deps, pre_softdeps, post_softdeps;
+        for (int dep : module.deps) deps.emplace_back(name(dep));
+        if (id > 0) out << ",";
+        if (module.join) {
+            out << "{\"name\":\"" << name(id) << "\",\"join\":true,\"level\":" << module.level
+                << ",\"deps\":";
+            WriteJsonList(out, deps);
+            out << "}";
+            continue;
+        }
+        GetAllDependencies(module.name, &pre_softdeps, nullptr, &post_softdeps);
+        auto dependencies = GetDependencies(module.name);
+        auto options_iter = module_options_.find(module.name);
+
+        out << "{\"name\":\"" << JsonEscape(module.name) << "\",\"path\":\""
+            << JsonEscape(dependencies.empty() ? "" : dependencies[0]) << "\""
+            << ",\"listed\":" << (module.listed ? "true" : "false")
+            << ",\"level\":" << module.level
+            << ",\"sequential\":" << (module.sequential ? "true" : "false")
+            << ",\"options\":\""
+            << JsonEscape(options_iter == module_options_.end() ? "" : options_iter->second)
+            << "\"";
+        if (!module.error.empty()) {
+            out << ",\"error\":\"" << JsonEscape(module.error) << "\"";
+        }
+        // A listed name without a modules.dep line loads whatever it aliases.
+        if (module.listed && dependencies.empty()) {
+            out << ",\"aliases\":";
+            WriteJsonList(out, FindAliases(module.name));
+        }
+        out << ",\"deps\":";
+        WriteJsonList(out, deps);
+        out << ",\"pre_softdeps\":";
+        WriteJsonList(out, pre_softdeps);
+        out << ",\"post_softdeps\":";
+        WriteJsonList(out, post_softdeps);
+        // Softdeps without a modules.dep line load whatever they alias.
+        out << ",\"softdep_aliases\":{";
+        std::set<std::string> aliased;
+        for (const auto* softdeps : {&pre_softdeps, &post_softdeps}) {
+            for (const auto& softdep : *softdeps) {
+                if (GetModuleId(MakeCanonical(softdep)) >= 0) continue;
+                if (!aliased.insert(softdep).second) continue;
+                if (aliased.size() > 1) out << ",";
+                out << "\"" << JsonEscape(softdep) << "\":";
+                WriteJsonList(out, FindAliases(softdep));
+            }
         }
+        out << "}}";
+    }
+    out << "]}" << std::endl;
+    return ret;
+}
 
-        if (!ret) return ret;
+namespace {
 
-        std::lock_guard guard(module_loaded_lock_);
-        // Remove loaded module form mod_with_deps and soft dependencies of other modules
-        for (const auto& module_loaded : module_loaded_)
-            mod_with_deps.erase(module_loaded);
+// Estimates of the heap memory behind the parsed tables. Hash containers are
+// counted as libstdc++ lays them out: a bucket array plus one node per
+// element holding the next pointer, the element and its cached hash.
+size_t HeapBytes(int) {
+    return 0;
+}
 
-        // Remove loaded module form dependencies of other modules which are not loaded yet
-        for (const auto& module_loaded_path : module_loaded_paths_) {
-            for (auto& [mod, deps] : mod_with_deps) {
-                auto it = std::find(deps.begin(), deps.end(), module_loaded_path);
-                if (it != deps.end()) {
-                    deps.erase(it);
-                }
+size_t HeapBytes(const std::string& str) {
+    // Short strings live in the object itself.
+    return str.capacity() > std::string().capacity() ? str.capacity() + 1 : 0;
+}
+
+template <typename A, typename B>
+size_t HeapBytes(const std::pair<A, B>& pair);
+template <typename T>
+size_t HeapBytes(const std::vector<T>& vec);
+
+template <typename A, typename B>
+size_t HeapBytes(const std::pair<A, B>& pair) {
+    return HeapBytes(pair.first) + HeapBytes(pair.second);
+}
+
+template <typename T>
+size_t HeapBytes(const std::vector<T>& vec) {
+    size_t bytes = vec.capacity() * sizeof(T);
+    for (const auto& item : vec) bytes += HeapBytes(item);
+    return bytes;
+}
+
+template <typename Container>
+size_t HashBytes(const Container& container) {
+    size_t bytes = container.bucket_count() * sizeof(void*) +
+                   container.size() * (sizeof(typename Container::value_type) + 2 * sizeof(void*));
+    for (const auto& item : container) bytes += HeapBytes(item);
+    return bytes;
+}
+
+}  // namespace
+
+std::vector<std::pair<std::string, size_t>> Modprobe::MemoryUsage() {
+    size_t index = HashBytes(module_ids_) + HeapBytes(module_dep_ids_) + HashBytes(module_base_) +
+                   module_names_.capacity() * sizeof(module_names_[0]) +
+                   module_ids_.size() * (sizeof(module_state_[0]) + sizeof(module_fds_[0]));
+    for (const auto& closure : module_closure_) index += sizeof(closure) + closure.Bytes();
+
+    return {
+            {"aliases", HeapBytes(module_aliases_)},
+            {"deps", HashBytes(module_deps_)},
+            {"softdeps", HeapBytes(module_pre_softdep_) + HeapBytes(module_post_softdep_)},
+            {"load", HeapBytes(module_load_)},
+            {"options", HashBytes(module_options_)},
+            {"blocklist", HashBytes(module_blocklist_) + module_blocklist_filter_.Bytes() +
+                                  module_blocked_.Bytes()},
+            {"builtin", HashBytes(module_builtin_)},
+            {"index", index},
+    };
+}
+
+void Modprobe::Compact(bool listed) {
+    LoadPlan plan;
+    if (listed) {
+        BuildListedLoadPlan(&plan);
+    } else {
+        BuildLoadPlan(&plan);
+    }
+    // Aliases are parsed lazily, so they have to be in before they can be
+    // trimmed.
+    ParseAliases();
+
+    std::unordered_map<std::string, std::vector<const std::string*>> softdeps;
+    for (const auto* table : {&module_pre_softdep_, &module_post_softdep_}) {
+        for (const auto& [module, softdep] : *table) {
+            softdeps[MakeCanonical(module)].emplace_back(&softdep);
+        }
+    }
+
+    // Everything loading the plan can touch: its modules, their soft
+    // dependencies, whatever those resolve to and their hard deps in turn.
+    ModuleBitset keep(module_ids_.size());
+    std::vector<int> pending;
+    auto add = [&](int id) {
+        if (id >= 0 && !keep.Test(id)) {
+            keep.Set(id);
+            pending.emplace_back(id);
+        }
+    };
+    for (const auto& module : plan.modules) {
+        if (module.join) continue;
+        int id = GetModuleId(module.name);
+        if (id >= 0) {
+            add(id);
+            continue;
+        }
+        for (const auto& aliased_module : FindAliases(module.name)) {
+            add(GetModuleId(MakeCanonical(aliased_module)));
+        }
+    }
+    while (!pending.empty()) {
+        int id = pending.back();
+        pending.pop_back();
+        for (int dep : module_dep_ids_[id]) add(dep);
+        auto it = softdeps.find(*module_names_[id]);
+        if (it == softdeps.end()) continue;
+        for (const auto* softdep : it->second) {
+            int softdep_id = GetModuleId(MakeCanonical(*softdep));
+            if (softdep_id >= 0) {
+                add(softdep_id);
+                continue;
+            }
+            for (const auto& aliased_module : FindAliases(*softdep)) {
+                add(GetModuleId(MakeCanonical(aliased_module)));
             }
         }
     }
 
+    auto kept = [&](const std::string& module) {
+        int id = GetModuleId(MakeCanonical(module));
+        return id >= 0 && keep.Test(id);
+    };
+    auto compact = [&](std::vector<std::pair<std::string, std::string>>& table, bool by_key) {
+        table.erase(std::remove_if(table.begin(), table.end(),
+                                   [&](const auto& entry) {
+                                       return !kept(by_key ? entry.first : entry.second);
+                                   }),
+                    table.end());
+        table.shrink_to_fit();
+    };
+    compact(module_pre_softdep_, true);
+    compact(module_post_softdep_, true);
+    compact(module_aliases_, false);
+    for (auto it = module_options_.begin(); it != module_options_.end();) {
+        it = kept(it->first) ? std::next(it) : module_options_.erase(it);
+    }
+    module_options_.rehash(0);
+    for (auto it = module_deps_.begin(); it != module_deps_.end();) {
+        if (kept(it->first)) {
+            ++it;
+            continue;
+        }
+        module_base_.erase(it->first);
+        it = module_deps_.erase(it);
+    }
+    module_deps_.rehash(0);
+    module_base_.rehash(0);
+}
+
+// Another option to load kernel modules. Build the dependency graph of the
+// listed modules and load it with RunDependencyGraph(), so independent
+// modules load in parallel and each module starts as soon as its hard
+// dependencies are in. Modules with load_sequential=1 never run
+// concurrently with any other load.
+// Softdeps are taken care in InsmodWithDeps().
+bool Modprobe::LoadModulesParallel(int num_threads) {
+    std::optional<PhaseTimer::Scope> timer(std::in_place, "schedule");
+    LoadPlan plan;
+    BuildLoadPlan(&plan);
+    for (const auto& module : plan.blocklisted) {
+        std::cout << "LMP: Blocklist: Module " << module << " skipping..." << std::endl;
+    }
+
+    std::vector<std::vector<int>> dependents;
+    std::vector<int> pending_deps;
+    for (const auto& module : plan.modules) {
+        dependents.emplace_back(module.dependents);
+        pending_deps.emplace_back(module.deps.size());
+    }
+
+    timer.emplace("load");
+    if (adaptive_load_) load_limiter_ = std::make_unique<LoadLimiter>(num_threads);
+    std::shared_mutex sequential_lock;
+    std::vector<int> blame;
+    bool ret = RunDependencyGraph(dependents, pending_deps, num_threads, worker_config_, &blame,
+                                  [&](int id) {
+        const auto& module = plan.modules[id];
+        if (!module.error.empty()) {
+            std::cout << "LMP: " << module.error << std::endl;
+            return false;
+        }
+        if (module.sequential) {
+            std::unique_lock lk(sequential_lock);
+            return LoadWithAliases(module.name, true);
+        }
+        std::shared_lock lk(sequential_lock);
+        return LoadWithAliases(module.name, true);
+    });
+    load_limiter_.reset();
+    if (!ret) {
+        ReportGraphFailures("LMP: ", blame, [&](int id) -> const std::string& {
+            return plan.modules[id].name;
+        });
+    }
     return ret;
 }
 
-bool Modprobe::LoadListedModules() {
-    auto ret = true;
-    for (const auto& module : module_load_) {
-        if (!LoadWithAliases(module, true)) {
-            if (IsBlocklisted(module)) continue;
+bool Modprobe::IsLoadSequential(const std::string& canonical_name) {
+    auto options_iter = module_options_.find(canonical_name);
+    return options_iter != module_options_.end() &&
+           options_iter->second.find("load_sequential=1") != std::string::npos;
+}
+
+// Load the modules in modules.load in order. With more than one thread the
+// graph of BuildListedLoadPlan() runs on RunDependencyGraph(), so unrelated
+// modules load concurrently. The list order still holds where it matters:
+// a listed name that brings in a load_sequential=1 module, itself or as a
+// dep, starts once everything before it is done, and nothing after it
+// starts before it is in. Failures do not stop the rest of the list, as
+// when loading one by one.
+bool Modprobe::LoadListedModules(int num_threads) {
+    if (num_threads <= 1) {
+        PhaseTimer::Scope timer("load");
+        auto ret = true;
+        // A single worker, run with the same config as the graph's workers.
+        std::thread worker([&] {
+            ApplyWorkerConfig(worker_config_, true);
+            for (const auto& module : module_load_) {
+                if (!LoadWithAliases(module, true)) {
+                    if (IsBlocklisted(module)) continue;
+                    ret = false;
+                }
+            }
+        });
+        worker.join();
+        return ret;
+    }
+
+    std::optional<PhaseTimer::Scope> timer(std::in_place, "schedule");
+    LoadPlan plan;
+    BuildListedLoadPlan(&plan);
+    std::vector<std::vector<int>> dependents;
+    std::vector<int> pending_deps;
+    for (const auto& module : plan.modules) {
+        dependents.emplace_back(module.dependents);
+        pending_deps.emplace_back(module.deps.size());
+    }
+
+    timer.emplace("load");
+    if (adaptive_load_) load_limiter_ = std::make_unique<LoadLimiter>(num_threads);
+    std::atomic<bool> ret = true;
+    std::shared_mutex sequential_lock;
+    RunDependencyGraph(dependents, pending_deps, num_threads, worker_config_, nullptr, [&](int id) {
+        const auto& node = plan.modules[id];
+        if (node.join) {
+            return true;
+        }
+        // Nothing to try, and returning false would take down everything
+        // behind the next barrier along with what needs the node.
+        if (!node.error.empty()) {
+            std::cout << node.error << std::endl;
+            if (node.listed) ret = false;
+            return true;
+        }
+        bool loaded;
+        if (node.sequential) {
+            std::unique_lock lk(sequential_lock);
+            loaded = LoadWithAliases(node.name, true);
+        } else {
+            std::shared_lock lk(sequential_lock);
+            loaded = LoadWithAliases(node.name, true);
+        }
+        // A dep that failed fails the listed modules needing it, those are
+        // the ones that count.
+        if (!loaded && node.listed && !IsBlocklisted(node.name)) {
             ret = false;
         }
-    }
+        return true;
+    });
+    load_limiter_.reset();
     return ret;
 }
 
 bool Modprobe::Remove(const std::string& module_name) {
-    auto dependencies = GetDependencies(MakeCanonical(module_name));
-    for (auto dep = dependencies.begin(); dep != dependencies.end(); ++dep) {
-        Rmmod(*dep);
+    return RemoveModules({module_name}, 1);
+}
+
+// Unload module_names and every module they use that nothing else uses.
+// Builds the reverse dependency graph of loaded modules from /proc/modules
+// and unloads it leaves first: a module is removed once all of its users
+// are gone, independent modules in parallel. With dry_run only the unload
+// order is printed.
+bool Modprobe::RemoveModules(const std::vector<std::string>& module_names, int num_threads,
+                             bool dry_run) {
+    std::unordered_map<std::string, LoadedModule> loaded;
+    if (!GetLoadedModules(&loaded)) {
+        return false;
     }
-    Rmmod(module_name);
-    return true;
+
+    std::unordered_map<std::string, std::vector<std::string>> uses;
+    for (const auto& [module, info] : loaded) {
+        for (const auto& user : info.users) {
+            uses[user].emplace_back(module);
+        }
+    }
+
+    std::unordered_map<std::string, int> node_ids;
+    std::vector<std::string> nodes;
+    auto add_node = [&](const std::string& name) {
+        if (node_ids.emplace(name, nodes.size()).second) {
+            nodes.emplace_back(name);
+        }
+    };
+
+    auto ret = true;
+    for (const auto& module : module_names) {
+        auto canonical_name = MakeCanonical(module);
+        if (!loaded.count(canonical_name)) {
+            std::cout << "Module " << module << " is not loaded" << std::endl;
+            ret = false;
+            continue;
+        }
+        add_node(canonical_name);
+    }
+    // Pull in everything the requested modules use, nodes grows as we go.
+    for (size_t id = 0; id < nodes.size(); id++) {
+        for (const auto& dep : uses[nodes[id]]) {
+            add_node(dep);
+        }
+    }
+
+    // A module can only go if all its users go with it and nothing outside
+    // the module graph holds a reference. Dropping one module keeps the
+    // modules it uses alive too, so repeat until nothing changes.
+    std::set<std::string> requested;
+    for (const auto& module : module_names) requested.emplace(MakeCanonical(module));
+    std::vector<bool> removable(nodes.size(), true);
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (size_t id = 0; id < nodes.size(); id++) {
+            if (!removable[id]) continue;
+            const auto& info = loaded[nodes[id]];
+            std::string holder;
+            for (const auto& user : info.users) {
+                auto it = node_ids.find(user);
+                if (it == node_ids.end() || !removable[it->second]) {
+                    holder = user;
+                    break;
+                }
+            }
+            if (holder.empty() && info.refcount <= static_cast<int>(info.users.size())) {
+                continue;
+            }
+            removable[id] = false;
+            changed = true;
+            if (requested.count(nodes[id])) {
+                std::cout << "Module " << nodes[id] << " is in use"
+                          << (holder.empty() ? "" : " by " + holder) << std::endl;
+                ret = false;
+            }
+        }
+    }
+
+    // Edges run from a user to each module it uses: those wait on it.
+    std::vector<int> ids;
+    std::vector<int> index(nodes.size(), -1);
+    for (size_t id = 0; id < nodes.size(); id++) {
+        if (removable[id]) {
+            index[id] = ids.size();
+            ids.emplace_back(id);
+        }
+    }
+    std::vector<std::vector<int>> dependents(ids.size());
+    std::vector<int> pending_users(ids.size());
+    for (size_t i = 0; i < ids.size(); i++) {
+        for (const auto& dep : uses[nodes[ids[i]]]) {
+            int dep_index = index[node_ids[dep]];
+            if (dep_index < 0) continue;
+            dependents[i].emplace_back(dep_index);
+            pending_users[dep_index]++;
+        }
+    }
+
+    if (dry_run) {
+        // Print the unload levels a parallel run would go through.
+        std::vector<int> pending = pending_users;
+        std::vector<int> level;
+        for (size_t i = 0; i < ids.size(); i++) {
+            if (pending[i] == 0) level.emplace_back(i);
+        }
+        for (int depth = 0; !level.empty(); depth++) {
+            std::vector<int> next;
+            std::cout << "Unload level " << depth << ":";
+            for (int i : level) {
+                std::cout << " " << nodes[ids[i]];
+                for (int dep : dependents[i]) {
+                    if (--pending[dep] == 0) next.emplace_back(dep);
+                }
+            }
+            std::cout << std::endl;
+            level = std::move(next);
+        }
+        return ret;
+    }
+
+    // A module whose user failed to unload stays, as does what it uses.
+    std::vector<int> blame;
+    if (!RunDependencyGraph(dependents, pending_users, num_threads, worker_config_, &blame,
+                            [&](int i) { return Rmmod(nodes[ids[i]]); })) {
+        ReportGraphFailures("Unload: ", blame,
+                            [&](int i) -> const std::string& { return nodes[ids[i]]; });
+        ret = false;
+    }
+    return ret;
 }
 
 std::vector<std::string> Modprobe::ListModules(const std::string& pattern) {
@@ -618,7 +1814,12 @@ std::vector<std::string> Modprobe::ListModules(const std::string& pattern) {
         if (!fnmatch(pattern.c_str(), module.c_str(), 0)) {
             rv.emplace_back(module);
         } else if (!fnmatch(pattern.c_str(), Basename(deps[0]).c_str(), 0)) {
-            rv.emplace_back(deps[0]);
+            auto base = module_base_.find(module);
+            if (deps[0][0] != '/' && base != module_base_.end()) {
+                rv.emplace_back(base_paths_[base->second] + "/" + deps[0]);
+            } else {
+                rv.emplace_back(deps[0]);
+            }
         }
     }
     return rv;
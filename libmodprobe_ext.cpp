@@ -19,8 +19,12 @@
 
 class UniqueFd {
 public:
-    UniqueFd(const std::string& path) {
-        fd = TEMP_FAILURE_RETRY(open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC));
+    UniqueFd() = default;
+
+    explicit UniqueFd(int fd) : fd(fd) {}
+
+    UniqueFd(int dirfd, const std::string& path) {
+        fd = TEMP_FAILURE_RETRY(openat(dirfd, path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC));
     }
 
     ~UniqueFd() {
@@ -57,18 +61,106 @@ public:
         return fd;
     }
 
+    int release() {
+        int ret = fd;
+        fd = -1;
+        return ret;
+    }
+
 private:
     int fd = -1;
 };
 
+// Stands in for finit_module when benchmarking: keeps the CPU busy for
+// cost_us, as relocating and initializing a module would, and succeeds.
+// The second half runs under a lock shared by all loads, the way the
+// kernel serializes part of every load on module_mutex.
+static int SimulateLoad(int cost_us) {
+    static std::mutex module_mutex;
+    auto spin = [](std::chrono::microseconds duration) {
+        auto end = std::chrono::steady_clock::now() + duration;
+        while (std::chrono::steady_clock::now() < end) {
+        }
+    };
+    spin(std::chrono::microseconds(cost_us - cost_us / 2));
+    std::lock_guard guard(module_mutex);
+    spin(std::chrono::microseconds(cost_us / 2));
+    return 0;
+}
+
+LoadLimiter::LoadLimiter(int max_limit) : max_limit_(std::max(max_limit, 1)) {
+    PhaseTimer::Get().Sample("load_limit", limit_);
+}
+
+void LoadLimiter::Acquire() {
+    std::unique_lock lk(lock_);
+    cv_.wait(lk, [&] { return in_flight_ < limit_; });
+    in_flight_++;
+}
+
+void LoadLimiter::Release(std::chrono::steady_clock::duration latency, off_t size) {
+    // Tiny modules cost about the same as small ones, do not let their
+    // per-byte cost swing the averages.
+    constexpr off_t kMinSize = 64 * 1024;
+    double cost = std::chrono::duration<double, std::nano>(latency).count() /
+                  std::max(size, kMinSize);
+
+    std::lock_guard guard(lock_);
+    in_flight_--;
+    average_cost_ = average_cost_ ? 0.95 * average_cost_ + 0.05 * cost : cost;
+    if (draining_ > 0) {
+        // Admitted under the limit before the last decrease, this load says
+        // nothing about the current one.
+        draining_--;
+    } else {
+        recent_cost_ = recent_cost_ ? 0.7 * recent_cost_ + 0.3 * cost : cost;
+        if (++window_ >= limit_) {
+            window_ = 0;
+            int limit = limit_;
+            if (recent_cost_ > average_cost_ * 1.5) {
+                limit_ = std::max(limit_ / 2, 1);
+                draining_ = in_flight_;
+                recent_cost_ = average_cost_;
+            } else if (limit_ < max_limit_) {
+                limit_++;
+            }
+            if (limit_ != limit) PhaseTimer::Get().Sample("load_limit", limit_);
+        }
+    }
+    cv_.notify_all();
+}
+
 bool Modprobe::Insmod(const std::string& path_name, const std::string& parameters) {
-    UniqueFd fd(path_name);
+    auto canonical_name = MakeCanonical(path_name);
+    int id = GetModuleId(canonical_name);
+
+    // Claim the module so no other worker can insmod it at the same time.
+    if (id >= 0) {
+        ModuleState state = ModuleState::kUnloaded;
+        if (!module_state_[id].compare_exchange_strong(state, ModuleState::kLoading)) {
+            if (state == ModuleState::kLoading) {
+                // Another worker is inside finit_module for it, wait for its result.
+                duplicate_loads_avoided_++;
+                state = WaitForModule(id);
+            }
+            return state == ModuleState::kLoaded;
+        }
+    }
+    auto set_state = [&](ModuleState state) {
+        if (id >= 0) SetModuleState(id, state);
+    };
+
+    // The claim makes this call the only user of the cached fd, it is
+    // closed once the kernel has seen the file.
+    UniqueFd module_fd = id >= 0 ? UniqueFd(TakeModuleFd(id, path_name))
+                                 : UniqueFd(GetBaseFd(canonical_name), path_name);
+    int fd = module_fd.get();
 
-    if (fd.get() == -1) {
+    if (fd == -1) {
+        set_state(ModuleState::kFailed);
         return false;
     }
 
-    auto canonical_name = MakeCanonical(path_name);
     std::string options = "";
     auto options_iter = module_options_.find(canonical_name);
     if (options_iter != module_options_.end()) {
@@ -79,24 +171,33 @@ bool Modprobe::Insmod(const std::string& path_name, const std::string& parameter
     }
 
     std::cout << "Loading module " << path_name << " with args '" << options << "'" << std::endl;
-    int ret = syscall(__NR_finit_module, fd.get(), options.c_str(), 0);
+    struct stat st = {};
+    if (load_limiter_) {
+        fstat(fd, &st);
+        load_limiter_->Acquire();
+    }
+    auto start = std::chrono::steady_clock::now();
+    int ret = simulated_load_us_ ? SimulateLoad(simulated_load_us_)
+                                 : syscall(__NR_finit_module, fd, options.c_str(), 0);
+    if (load_limiter_) {
+        int saved_errno = errno;
+        load_limiter_->Release(std::chrono::steady_clock::now() - start, st.st_size);
+        errno = saved_errno;
+    }
     if (ret != 0) {
         if (errno == EEXIST) {
             // Module already loaded
-            std::lock_guard guard(module_loaded_lock_);
-            module_loaded_paths_.emplace(path_name);
-            module_loaded_.emplace(canonical_name);
+            set_state(ModuleState::kLoaded);
             return true;
         }
         std::cout << "Failed to insmod '" << path_name << "' with args '" << options << "'" << std::endl;
+        set_state(ModuleState::kFailed);
         return false;
     }
 
     std::cout << "Loaded kernel module " << path_name << std::endl;
-    std::lock_guard guard(module_loaded_lock_);
-    module_loaded_paths_.emplace(path_name);
-    module_loaded_.emplace(canonical_name);
     module_count_++;
+    set_state(ModuleState::kLoaded);
     return true;
 }
 
@@ -107,11 +208,58 @@ bool Modprobe::Rmmod(const std::string& module_name) {
         std::cout << "Failed to remove module '" << module_name << "'" << std::endl;
         return false;
     }
-    std::lock_guard guard(module_loaded_lock_);
-    module_loaded_.erase(canonical_name);
+    int id = GetModuleId(canonical_name);
+    if (id >= 0) SetModuleState(id, ModuleState::kUnloaded);
+    return true;
+}
+
+bool Modprobe::GetLoadedModules(std::unordered_map<std::string, LoadedModule>* loaded) {
+    std::string contents;
+    if (!ReadFileToString("/proc/modules", &contents)) {
+        std::cout << "Unable to read /proc/modules" << std::endl;
+        return false;
+    }
+
+    // name size refcount users state address, users being "-" or "a,b,"
+    for (const auto& line : SplitString(contents, "\n")) {
+        auto fields = SplitString(line, " ");
+        if (fields.size() < 4) continue;
+        auto& module = (*loaded)[fields[0]];
+        module.refcount = atoi(fields[2].c_str());
+        if (fields[3] != "-") {
+            module.users = SplitString(fields[3], ",");
+        }
+    }
     return true;
 }
 
+// Hands the cached fd over to the caller, opening one if none is cached.
+// Only one caller owns an fd at a time, so none can close it under another.
+int Modprobe::TakeModuleFd(int id, const std::string& path_name) {
+    int fd = module_fds_[id].exchange(-1);
+    if (fd != -1) {
+        return fd;
+    }
+    return UniqueFd(GetBaseFd(MakeCanonical(path_name)), path_name).release();
+}
+
+// Caches fd for the Insmod that follows an existence check. Once the
+// module has been claimed nothing will take it again, so it is closed.
+void Modprobe::ReturnModuleFd(int id, int fd) {
+    int expected = -1;
+    if (module_state_[id] != ModuleState::kUnloaded ||
+        !module_fds_[id].compare_exchange_strong(expected, fd)) {
+        close(fd);
+    }
+}
+
+void Modprobe::CloseModuleFd(int id) {
+    int fd = module_fds_[id].exchange(-1);
+    if (fd != -1) {
+        close(fd);
+    }
+}
+
 bool Modprobe::ModuleExists(const std::string& module_name) {
     struct stat fileStat {};
     if (blocklist_enabled && module_blocklist_.count(module_name)) {
@@ -123,7 +271,16 @@ bool Modprobe::ModuleExists(const std::string& module_name) {
         // missing deps can happen in the case of an alias
         return false;
     }
-    if (stat(deps.front().c_str(), &fileStat)) {
+    int id = GetModuleId(module_name);
+    // A claimed module was found loadable by the worker loading it.
+    if (id >= 0 && module_state_[id] != ModuleState::kUnloaded &&
+        module_state_[id] != ModuleState::kFailed) {
+        return true;
+    }
+    int fd = id >= 0 ? TakeModuleFd(id, deps.front()) : -1;
+    int stat_ret = fd != -1 ? fstat(fd, &fileStat) : -1;
+    if (fd != -1) ReturnModuleFd(id, fd);
+    if (stat_ret) {
         std::cout << "module " << module_name << " can't be loaded; can't access " << deps.front() << std::endl;
         return false;
     }
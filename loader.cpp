@@ -0,0 +1,278 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ * Copyright (C) 2024 Bardia Moshiri <fakeshell@bardia.tech>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "loader.h"
+
+std::string GetPageSizeSuffix() {
+    static const size_t page_size = sysconf(_SC_PAGE_SIZE);
+    if (page_size <= 4096) {
+        return "";
+    }
+
+    std::ostringstream oss;
+    oss << "_" << (page_size / 1024) << "k";
+
+    return oss.str();
+}
+
+std::string GetModuleLoadList(const std::string& dir_path) {
+    std::string module_load_file = "modules.load.recovery";
+    struct stat fileStat {};
+
+    std::string recovery_load_path = dir_path + "/" + module_load_file;
+    // Check if the .recovery file exists
+    if (stat(recovery_load_path.c_str(), &fileStat)) {
+        // If the .recovery file doesn't exist, use modules.load
+        module_load_file = "modules.load";
+    }
+
+    return module_load_file;
+}
+
+// Destroys a Modprobe instance, timed as the teardown phase.
+void Teardown(std::unique_ptr<Modprobe>& m) {
+    PhaseTimer::Scope timer("teardown");
+    m.reset();
+}
+
+// Cheap check that dir_path has a load list with at least one module in it,
+// done before paying for a full parse of the tree.
+bool HasModulesToLoad(const std::string& dir_path) {
+    std::ifstream load_list(dir_path + "/" + GetModuleLoadList(dir_path));
+    std::string line;
+    while (std::getline(load_list, line)) {
+        auto start = line.find_first_not_of(" \t");
+        if (start != std::string::npos && line[start] != '#') {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Prints the table sizes of m along with the heap in use, as malloc sees it,
+// and the peak RSS of the process so far.
+void ReportMemory(Modprobe& m, const char* stage) {
+    struct rusage usage {};
+    getrusage(RUSAGE_SELF, &usage);
+    size_t total = 0;
+    std::cout << "memory: " << stage;
+    for (const auto& [table, bytes] : m.MemoryUsage()) {
+        std::cout << " " << table << "=" << bytes;
+        total += bytes;
+    }
+    std::cout << " total=" << total << " heap=" << mallinfo2().uordblks
+              << " peak_rss=" << usage.ru_maxrss << "kB" << std::endl;
+}
+
+// Runs the report and compaction asked for in options on a parsed tree,
+// listed telling which scheduler is going to load it.
+void PrepareLoad(Modprobe& m, const LoadOptions& options, bool listed) {
+    if (options.memory_report) {
+        ReportMemory(m, "parsed");
+    }
+    if (!options.compact) {
+        return;
+    }
+    {
+        PhaseTimer::Scope timer("compact");
+        m.Compact(listed);
+    }
+    if (options.memory_report) {
+        ReportMemory(m, "compacted");
+    }
+}
+
+bool LoadKernelModules(const std::string& module_base_dir, int& modules_loaded,
+                       const LoadOptions& options) {
+    std::optional<PhaseTimer::Scope> scan_timer(std::in_place, "dir_scan");
+    struct utsname uts {};
+    if (uname(&uts)) {
+        std::cout << "Failed to get kernel version." << std::endl;
+    }
+    int major = 0, minor = 0;
+    if (sscanf(uts.release, "%d.%d", &major, &minor) != 2) {
+        std::cout << "Failed to parse kernel version " << uts.release << std::endl;
+    }
+
+    std::unique_ptr<DIR, decltype(&closedir)> base_dir(opendir(module_base_dir.c_str()), closedir);
+    if (!base_dir) {
+        std::cout << "Unable to open " << module_base_dir << ", skipping module loading." << std::endl;
+        return true;
+    }
+    dirent* entry = nullptr;
+    std::vector<std::string> module_dirs;
+    const auto page_size_suffix = GetPageSizeSuffix();
+    const std::string release_specific_module_dir = uts.release + page_size_suffix;
+    while ((entry = readdir(base_dir.get()))) {
+        if (entry->d_type != DT_DIR) {
+            continue;
+        }
+        if (entry->d_name == release_specific_module_dir) {
+            std::cout << "Release specific kernel module dir " << release_specific_module_dir
+                      << " found, loading modules from here with no fallbacks." << std::endl;
+            module_dirs.clear();
+            module_dirs.emplace_back(entry->d_name);
+            break;
+        }
+        // Is a directory does not have page size suffix, it does not mean this directory is for 4K
+        // kernels. Certain 16K kernel builds put all modules in /lib/modules/`uname -r` without any
+        // suffix. Therefore, only ignore a directory if it has _16k/_64k suffix and the suffix does
+        // not match system page size.
+        const auto dir_page_size_suffix = GetPageSizeSuffix();
+        if (!dir_page_size_suffix.empty() && dir_page_size_suffix != page_size_suffix) {
+            continue;
+        }
+        int dir_major = 0, dir_minor = 0;
+        if (sscanf(entry->d_name, "%d.%d", &dir_major, &dir_minor) != 2 || dir_major != major ||
+            dir_minor != minor) {
+            continue;
+        }
+        module_dirs.emplace_back(entry->d_name);
+    }
+
+    // Sort the directories so they are iterated over during module loading
+    // in a consistent order. Alphabetical sorting is fine here because the
+    // kernel version at the beginning of the directory name must match the
+    // current kernel version, so the sort only applies to a label that
+    // follows the kernel version, for example /lib/modules/5.4 vs.
+    // /lib/modules/5.4-gki.
+    std::sort(module_dirs.begin(), module_dirs.end());
+    scan_timer.reset();
+
+    // Trees are tried one at a time until one loads something, or all merged
+    // into one index with later trees overlaying earlier ones. A merged tree
+    // without a load list of its own still supplies dependencies, options
+    // and softdeps, so it is only skipped if no tree has anything to load.
+    std::vector<std::vector<std::string>> trees;
+    bool merged_has_modules = false;
+    for (const auto& module_dir : module_dirs) {
+        std::string dir_path = module_base_dir + "/";
+        dir_path.append(module_dir);
+        bool has_modules = HasModulesToLoad(dir_path);
+        if (!has_modules && !options.merge_trees) {
+            std::cout << "No modules to load in " << dir_path << ", skipping." << std::endl;
+            continue;
+        }
+        merged_has_modules |= has_modules;
+        if (options.merge_trees && !trees.empty()) {
+            trees.back().emplace_back(dir_path);
+        } else {
+            trees.push_back({dir_path});
+        }
+    }
+    if (options.merge_trees && !merged_has_modules) {
+        trees.clear();
+    }
+
+    for (const auto& tree : trees) {
+        std::string dir_path = tree.front();
+        for (size_t i = 1; i < tree.size(); i++) dir_path += " + " + tree[i];
+        // The load list is named after the first tree that has one.
+        auto load_dir = std::find_if(tree.begin(), tree.end(), HasModulesToLoad);
+        auto m = std::make_unique<Modprobe>(
+                tree, GetModuleLoadList(load_dir != tree.end() ? *load_dir : tree.front()));
+        if (options.plan_out) {
+            return m->WriteLoadPlan(*options.plan_out, true);
+        }
+        m->SetWorkerConfig(options.workers);
+        m->SetAdaptiveLoad(options.adaptive);
+        m->SetSimulatedLoad(options.simulated_load_us);
+        PrepareLoad(*m, options, true);
+        bool retval = m->LoadListedModules(options.jobs);
+        if (options.memory_report) {
+            ReportMemory(*m, "loaded");
+        }
+        modules_loaded = m->GetModuleCount();
+        if (modules_loaded > 0) {
+            std::cout << "Loaded " << modules_loaded << " modules from " << dir_path
+                      << ", avoided " << m->GetDuplicateLoadsAvoided() << " duplicate loads"
+                      << std::endl;
+            Teardown(m);
+            return retval;
+        }
+        Teardown(m);
+    }
+
+    if (!HasModulesToLoad(module_base_dir)) {
+        return true;
+    }
+    auto m = std::make_unique<Modprobe>(std::vector<std::string>{module_base_dir},
+                                        GetModuleLoadList(module_base_dir));
+    if (options.plan_out) {
+        return m->WriteLoadPlan(*options.plan_out);
+    }
+    m->SetWorkerConfig(options.workers);
+    m->SetAdaptiveLoad(options.adaptive);
+    m->SetSimulatedLoad(options.simulated_load_us);
+    PrepareLoad(*m, options, false);
+    bool retval = m->LoadModulesParallel(options.jobs);
+    if (options.memory_report) {
+        ReportMemory(*m, "loaded");
+    }
+
+    modules_loaded = m->GetModuleCount();
+    if (modules_loaded > 0) {
+        std::cout << "Loaded " << modules_loaded << " modules from " << module_base_dir
+                  << ", avoided " << m->GetDuplicateLoadsAvoided() << " duplicate loads"
+                  << std::endl;
+        Teardown(m);
+        return retval;
+    }
+    Teardown(m);
+    return true;
+}
+
+bool ParseCpuList(const std::string& list, std::vector<int>* cpus) {
+    for (const auto& range : SplitString(list, ",")) {
+        int first, last;
+        char extra;
+        int fields = sscanf(range.c_str(), "%d-%d%c", &first, &last, &extra);
+        if (fields == 1) {
+            last = first;
+        } else if (fields != 2) {
+            return false;
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE) {
+            return false;
+        }
+        for (int cpu = first; cpu <= last; cpu++) cpus->emplace_back(cpu);
+    }
+    return !cpus->empty();
+}
+
+bool ParseSchedPolicy(const std::string& arg, WorkerConfig* config) {
+    static const std::map<std::string, int> policies = {
+        {"other", SCHED_OTHER}, {"batch", SCHED_BATCH}, {"idle", SCHED_IDLE},
+        {"fifo", SCHED_FIFO},   {"rr", SCHED_RR},
+    };
+    auto colon = arg.find(':');
+    auto it = policies.find(arg.substr(0, colon));
+    if (it == policies.end()) {
+        return false;
+    }
+    config->policy = it->second;
+    bool realtime = config->policy == SCHED_FIFO || config->policy == SCHED_RR;
+    config->priority = realtime ? 1 : 0;
+    if (colon != std::string::npos) {
+        config->priority = atoi(arg.c_str() + colon + 1);
+        if (config->priority < sched_get_priority_min(config->policy) ||
+            config->priority > sched_get_priority_max(config->policy)) {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2024 Bardia Moshiri <fakeshell@bardia.tech>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "modprobe.h"
+
+// What LoadKernelModules() does besides loading.
+struct LoadOptions {
+    // Write the load plan of the tree here instead of loading it.
+    std::ostream* plan_out = nullptr;
+    bool memory_report = false;
+    // Drop what the load plan cannot use before loading.
+    bool compact = false;
+    // Load every matching tree below the base dir as one merged index.
+    bool merge_trees = false;
+    int jobs = std::thread::hardware_concurrency();
+    // Adapt the number of concurrent module loads to their latency.
+    bool adaptive = false;
+    WorkerConfig workers;
+    // Burn this much CPU per module instead of calling finit_module.
+    int simulated_load_us = 0;
+};
+
+// Loads modules from the first usable tree below module_base_dir, or writes
+// its load plan if options ask for that.
+bool LoadKernelModules(const std::string& module_base_dir, int& modules_loaded,
+                       const LoadOptions& options = {});
+
+// Parses a CPU list such as "0-3,6" into cpus.
+bool ParseCpuList(const std::string& list, std::vector<int>* cpus);
+
+// Parses POLICY[:PRIORITY], the policy being one of other, batch, idle,
+// fifo and rr, into config.
+bool ParseSchedPolicy(const std::string& arg, WorkerConfig* config);
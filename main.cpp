@@ -15,118 +15,153 @@
  * limitations under the License.
  */
 
-#include "modprobe.h"
+#include "loader.h"
 
 #define MODULE_BASE_DIR "/lib/modules"
 
-std::string GetPageSizeSuffix() {
-    static const size_t page_size = sysconf(_SC_PAGE_SIZE);
-    if (page_size <= 4096) {
-        return "";
-    }
-
-    std::ostringstream oss;
-    oss << "_" << (page_size / 1024) << "k";
-
-    return oss.str();
+void Usage(const char* argv0) {
+    std::cout << "Usage: " << argv0 << " [-d|--module-dir DIR] [-t|--timings[=json]] [-m|--memory]"
+              << " [-C|--compact] [-M|--merge-trees] [-A|--adaptive]" << std::endl
+              << "       " << std::string(strlen(argv0), ' ')
+              << " [-j|--jobs N] [-a|--cpus LIST] [-s|--sched POLICY[:PRIORITY]] [-N|--nice N]"
+              << std::endl
+              << "       " << argv0 << " -p|--plan[=FILE] [-d|--module-dir DIR]" << std::endl
+              << "       " << argv0 << " -r|--remove MODULE[,MODULE...] [-n|--dry-run]" << std::endl;
 }
 
-std::string GetModuleLoadList(const std::string& dir_path) {
-    std::string module_load_file = "modules.load.recovery";
-    struct stat fileStat {};
-
-    std::string recovery_load_path = dir_path + "/" + module_load_file;
-    // Check if the .recovery file exists
-    if (stat(recovery_load_path.c_str(), &fileStat)) {
-        // If the .recovery file doesn't exist, use modules.load
-        module_load_file = "modules.load";
-    }
-
-    return module_load_file;
-}
-
-bool LoadKernelModules(int& modules_loaded) {
-    struct utsname uts {};
-    if (uname(&uts)) {
-        std::cout << "Failed to get kernel version." << std::endl;
-    }
-    int major = 0, minor = 0;
-    if (sscanf(uts.release, "%d.%d", &major, &minor) != 2) {
-        std::cout << "Failed to parse kernel version " << uts.release << std::endl;
+int main(int argc, char** argv) {
+    auto main_start = PhaseTimer::Clock::now();
+    std::string module_base_dir = MODULE_BASE_DIR;
+    bool timings_json = false;
+    std::vector<std::string> remove_modules;
+    bool dry_run = false;
+    bool plan = false;
+    std::string plan_file;
+    LoadOptions load_options;
+    static const option long_options[] = {
+        {"module-dir", required_argument, nullptr, 'd'},
+        {"timings", optional_argument, nullptr, 't'},
+        {"remove", required_argument, nullptr, 'r'},
+        {"dry-run", no_argument, nullptr, 'n'},
+        {"plan", optional_argument, nullptr, 'p'},
+        {"memory", no_argument, nullptr, 'm'},
+        {"compact", no_argument, nullptr, 'C'},
+        {"merge-trees", no_argument, nullptr, 'M'},
+        {"jobs", required_argument, nullptr, 'j'},
+        {"cpus", required_argument, nullptr, 'a'},
+        {"sched", required_argument, nullptr, 's'},
+        {"nice", required_argument, nullptr, 'N'},
+        {"adaptive", no_argument, nullptr, 'A'},
+        {"help", no_argument, nullptr, 'h'},
+        {},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "d:t::r:np::mCMj:a:s:N:Ah", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case 'd':
+                module_base_dir = optarg;
+                break;
+            case 't':
+                if (optarg && std::string(optarg) != "json") {
+                    Usage(argv[0]);
+                    return 1;
+                }
+                timings_json = optarg != nullptr;
+                PhaseTimer::Get().Enable();
+                break;
+            case 'r':
+                for (const auto& module : SplitString(optarg, ",")) {
+                    remove_modules.emplace_back(module);
+                }
+                break;
+            case 'n':
+                dry_run = true;
+                break;
+            case 'p':
+                plan = true;
+                plan_file = optarg ? optarg : "";
+                break;
+            case 'm':
+                load_options.memory_report = true;
+                break;
+            case 'C':
+                load_options.compact = true;
+                break;
+            case 'M':
+                load_options.merge_trees = true;
+                break;
+            case 'j':
+                load_options.jobs = atoi(optarg);
+                if (load_options.jobs <= 0) {
+                    Usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'a':
+                if (!ParseCpuList(optarg, &load_options.workers.cpus)) {
+                    Usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 's':
+                if (!ParseSchedPolicy(optarg, &load_options.workers)) {
+                    Usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'N':
+                load_options.workers.nice = atoi(optarg);
+                if (load_options.workers.nice < -20 || load_options.workers.nice > 19) {
+                    Usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'A':
+                load_options.adaptive = true;
+                break;
+            case 'h':
+                Usage(argv[0]);
+                return 0;
+            default:
+                Usage(argv[0]);
+                return 1;
+        }
     }
 
-    std::unique_ptr<DIR, decltype(&closedir)> base_dir(opendir(MODULE_BASE_DIR), closedir);
-    if (!base_dir) {
-        std::cout << "Unable to open /lib/modules, skipping module loading." << std::endl;
-        return true;
-    }
-    dirent* entry = nullptr;
-    std::vector<std::string> module_dirs;
-    const auto page_size_suffix = GetPageSizeSuffix();
-    const std::string release_specific_module_dir = uts.release + page_size_suffix;
-    while ((entry = readdir(base_dir.get()))) {
-        if (entry->d_type != DT_DIR) {
-            continue;
-        }
-        if (entry->d_name == release_specific_module_dir) {
-            std::cout << "Release specific kernel module dir " << release_specific_module_dir
-                      << " found, loading modules from here with no fallbacks." << std::endl;
-            module_dirs.clear();
-            module_dirs.emplace_back(entry->d_name);
-            break;
-        }
-        // Is a directory does not have page size suffix, it does not mean this directory is for 4K
-        // kernels. Certain 16K kernel builds put all modules in /lib/modules/`uname -r` without any
-        // suffix. Therefore, only ignore a directory if it has _16k/_64k suffix and the suffix does
-        // not match system page size.
-        const auto dir_page_size_suffix = GetPageSizeSuffix();
-        if (!dir_page_size_suffix.empty() && dir_page_size_suffix != page_size_suffix) {
-            continue;
-        }
-        int dir_major = 0, dir_minor = 0;
-        if (sscanf(entry->d_name, "%d.%d", &dir_major, &dir_minor) != 2 || dir_major != major ||
-            dir_minor != minor) {
-            continue;
-        }
-        module_dirs.emplace_back(entry->d_name);
+    if (!remove_modules.empty()) {
+        // Unloading works off /proc/modules, the tree is only used for naming.
+        Modprobe m({module_base_dir});
+        m.SetWorkerConfig(load_options.workers);
+        return m.RemoveModules(remove_modules, load_options.jobs, dry_run) ? 0 : 1;
     }
 
-    // Sort the directories so they are iterated over during module loading
-    // in a consistent order. Alphabetical sorting is fine here because the
-    // kernel version at the beginning of the directory name must match the
-    // current kernel version, so the sort only applies to a label that
-    // follows the kernel version, for example /lib/modules/5.4 vs.
-    // /lib/modules/5.4-gki.
-    std::sort(module_dirs.begin(), module_dirs.end());
+    int modules_loaded = 0;
 
-    for (const auto& module_dir : module_dirs) {
-        std::string dir_path = MODULE_BASE_DIR "/";
-        dir_path.append(module_dir);
-        Modprobe m({dir_path}, GetModuleLoadList(dir_path));
-        bool retval = m.LoadListedModules();
-        modules_loaded = m.GetModuleCount();
-        if (modules_loaded > 0) {
-            std::cout << "Loaded " << modules_loaded << " modules from " << dir_path << std::endl;
-            return retval;
+    if (plan) {
+        // The log goes to stderr so stdout carries nothing but the JSON.
+        std::ostream plan_stdout(std::cout.rdbuf());
+        std::cout.rdbuf(std::cerr.rdbuf());
+        std::ofstream plan_stream;
+        if (!plan_file.empty()) {
+            plan_stream.open(plan_file);
+            if (!plan_stream) {
+                std::cout << "Unable to open " << plan_file << std::endl;
+                return 1;
+            }
         }
+        load_options.plan_out = plan_file.empty() ? &plan_stdout : &plan_stream;
+        bool ok = LoadKernelModules(module_base_dir, modules_loaded, load_options);
+        return ok ? 0 : 1;
     }
 
-    Modprobe m({MODULE_BASE_DIR}, GetModuleLoadList(MODULE_BASE_DIR));
-    bool retval = m.LoadModulesParallel(std::thread::hardware_concurrency());
+    LoadKernelModules(module_base_dir, modules_loaded, load_options);
+    std::cout << "Total modules loaded: " << modules_loaded << std::endl;
 
-    modules_loaded = m.GetModuleCount();
-    if (modules_loaded > 0) {
-        std::cout << "Loaded " << modules_loaded << " modules from " << MODULE_BASE_DIR << std::endl;
-        return retval;
+    auto& timer = PhaseTimer::Get();
+    if (timer.Enabled()) {
+        timer.Record("main", PhaseTimer::Clock::now() - main_start);
+        std::cout << (timings_json ? timer.Json() : timer.Summary()) << std::endl;
     }
-    return true;
-}
-
-int main() {
-    int modules_loaded = 0;
-
-    LoadKernelModules(modules_loaded);
-    std::cout << "Total modules loaded: " << modules_loaded << std::endl;
 
     return 0;
 }
@@ -16,9 +16,15 @@
 
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <mutex>
 #include <set>
+#include <shared_mutex>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
@@ -36,55 +42,335 @@
 #include <fnmatch.h>
 #include <sys/syscall.h>
 #include <map>
+#include <optional>
+#include <random>
+#include <malloc.h>
+#include <sys/resource.h>
+#include <sched.h>
+#include <cstring>
 #include <fcntl.h>
+#include <getopt.h>
+
+#include "kmod_index.h"
+#include "phase_timer.h"
+
+std::vector<std::string> SplitString(const std::string& str, const std::string& delimiters = " \n");
+bool ReadFileToString(const std::string& filePath, std::string* outString);
+std::string JsonEscape(const std::string& str);
+
+// Cursor over the space separated tokens of one config line. Tokens are
+// views into the line, which must outlive the cursor; nothing is copied.
+class TokenCursor {
+  public:
+    explicit TokenCursor(std::string_view line) : line_(line) {}
+
+    // Stores the next token in *token, false once the line is exhausted.
+    bool Next(std::string_view* token);
+    // Number of tokens on the whole line, for error messages.
+    size_t Count() const;
+
+  private:
+    std::string_view line_;
+    size_t pos_ = 0;
+};
+
+// A "module.option=value" argument of the kernel command line, as views into
+// the command line.
+struct CmdlineParam {
+    std::string_view module;
+    std::string_view option;
+    std::string_view value;
+    // The whole argument was quoted, the kernel drops those quotes so the
+    // value has to be quoted again when handed to the module.
+    bool quoted = false;
+};
+
+// Single pass over the kernel command line, splitting it the way the kernel's
+// next_arg() does: at whitespace outside double quotes, with a leading quote
+// quoting the whole argument, and stopping at "--" since everything past it
+// belongs to init. Only module options are returned; nothing is copied.
+class CmdlineCursor {
+  public:
+    explicit CmdlineCursor(std::string_view cmdline) : cmdline_(cmdline) {}
+
+    // Stores the next module option in *param, false once the command line
+    // is exhausted.
+    bool Next(CmdlineParam* param);
+
+  private:
+    std::string_view cmdline_;
+    size_t pos_ = 0;
+};
+
+// A module as listed in /proc/modules.
+struct LoadedModule {
+    int refcount = 0;
+    std::vector<std::string> users;
+};
+
+// What a parallel load would do: the dependency graph its workers run,
+// built without touching the kernel.
+struct LoadPlan {
+    struct Module {
+        std::string name;
+        std::vector<int> deps;
+        std::vector<int> dependents;
+        bool listed = false;
+        bool sequential = false;
+        // A no-op node, without a name, that waits for everything listed
+        // before a load_sequential=1 module so the module can wait for it.
+        bool join = false;
+        // Longest chain of loads this module waits for.
+        int level = 0;
+        // Why the module cannot be loaded, if it cannot. It fails without
+        // being tried, and the modules needing it are skipped.
+        std::string error;
+    };
+    std::vector<Module> modules;
+    std::vector<std::string> blocklisted;
+    // Listed modules compiled into the kernel, which need no loading.
+    std::vector<std::string> builtin;
+    // Number of modules on the longest dependency chain, the lower bound
+    // of sequential load steps however many threads are used.
+    int critical_path = 0;
+};
+
+// Bit filter in front of a set lookup: a clear bit proves the key is not
+// in the set without hashing into the set's buckets. Rebuilt from scratch
+// whenever the set changes.
+class BloomFilter {
+  public:
+    void Build(const std::unordered_set<std::string>& keys);
+    bool MayContain(const std::string& key) const;
+    size_t Bytes() const { return bits_.capacity() * sizeof(uint64_t); }
+
+  private:
+    std::vector<uint64_t> bits_;
+    size_t mask_ = 0;
+};
+
+// Set of module IDs, sized for the module index.
+class ModuleBitset {
+  public:
+    ModuleBitset() = default;
+    explicit ModuleBitset(size_t size) : words_((size + 63) / 64) {}
+
+    void Set(int id) { words_[id / 64] |= 1ULL << (id % 64); }
+    bool Test(int id) const { return words_[id / 64] >> (id % 64) & 1; }
+    bool Empty() const { return words_.empty(); }
+    size_t Bytes() const { return words_.capacity() * sizeof(uint64_t); }
+
+    ModuleBitset& operator|=(const ModuleBitset& other) {
+        for (size_t i = 0; i < std::min(words_.size(), other.words_.size()); i++) {
+            words_[i] |= other.words_[i];
+        }
+        return *this;
+    }
+
+    bool Intersects(const ModuleBitset& other) const {
+        for (size_t i = 0; i < std::min(words_.size(), other.words_.size()); i++) {
+            if (words_[i] & other.words_[i]) return true;
+        }
+        return false;
+    }
+
+    template <typename F>
+    void ForEach(F f) const {
+        for (size_t i = 0; i < words_.size(); i++) {
+            for (uint64_t word = words_[i]; word; word &= word - 1) {
+                f(i * 64 + __builtin_ctzll(word));
+            }
+        }
+    }
+
+  private:
+    std::vector<uint64_t> words_;
+};
+
+// Scheduling of the loader threads. The defaults leave them as inherited.
+struct WorkerConfig {
+    // CPUs the threads may run on, all of them if empty.
+    std::vector<int> cpus;
+    int policy = SCHED_OTHER;
+    // Only meaningful for SCHED_FIFO and SCHED_RR.
+    int priority = 0;
+    int nice = 0;
+};
+
+// Caps the finit_module calls in flight, AIMD style. Every window of
+// `limit` completions is judged by the recent load latency per byte of
+// module against the long-run average: if it has risen by half, the loads
+// are contending in the kernel and the limit halves, otherwise it grows by
+// one up to max_limit.
+class LoadLimiter {
+  public:
+    explicit LoadLimiter(int max_limit);
+
+    void Acquire();
+    void Release(std::chrono::steady_clock::duration latency, off_t size);
+
+  private:
+    std::mutex lock_;
+    std::condition_variable cv_;
+    int max_limit_;
+    int limit_ = 1;
+    int in_flight_ = 0;
+    int window_ = 0;
+    // Loads still in flight from before the last decrease.
+    int draining_ = 0;
+    // Nanoseconds per byte, averaged over the last few loads and the run.
+    double recent_cost_ = 0;
+    double average_cost_ = 0;
+};
+
+enum class ModuleState : uint8_t {
+    kUnloaded,
+    kLoading,
+    kLoaded,
+    kFailed,
+};
 
 class Modprobe {
   public:
     Modprobe(const std::vector<std::string>&, const std::string load_file = "modules.load",
              bool use_blocklist = true);
+    ~Modprobe();
 
     bool LoadModulesParallel(int num_threads);
-    bool LoadListedModules();
+    bool LoadListedModules(int num_threads = 1);
+    bool BuildLoadPlan(LoadPlan* plan);
+    bool BuildListedLoadPlan(LoadPlan* plan);
+    // Writes the plan of LoadListedModules() if listed is set, else the one
+    // of LoadModulesParallel().
+    bool WriteLoadPlan(std::ostream& out, bool listed = false);
     bool LoadWithAliases(const std::string& module_name, bool strict,
                          const std::string& parameters = "");
     bool Remove(const std::string& module_name);
+    bool RemoveModules(const std::vector<std::string>& module_names, int num_threads,
+                       bool dry_run = false);
     std::vector<std::string> ListModules(const std::string& pattern);
     bool GetAllDependencies(const std::string& module, std::vector<std::string>* pre_dependencies,
                             std::vector<std::string>* dependencies,
                             std::vector<std::string>* post_dependencies);
+    // modules.alias is only parsed once a name without a modules.dep line
+    // needs resolving; this parses it right away if that has not happened.
+    void ParseAliases();
+    void SetWorkerConfig(const WorkerConfig& config) { worker_config_ = config; }
+    // Makes Insmod() burn cost_us of CPU instead of calling finit_module,
+    // for benchmarking the scheduler without loading anything.
+    void SetSimulatedLoad(int cost_us) { simulated_load_us_ = cost_us; }
+    // Lets parallel loads adapt the number of concurrent finit_module calls
+    // to the measured load latency instead of running one per thread.
+    void SetAdaptiveLoad(bool adaptive) { adaptive_load_ = adaptive; }
+    // Estimated heap bytes held by each table, in a fixed order.
+    std::vector<std::pair<std::string, size_t>> MemoryUsage();
+    // Drops the modules.dep lines, softdeps, options and aliases of modules
+    // that loading the plan, soft dependencies and aliases included, can
+    // never reach. listed picks the plan of LoadListedModules() over the one
+    // of LoadModulesParallel().
+    void Compact(bool listed = false);
     int GetModuleCount() { return module_count_; }
+    int GetDuplicateLoadsAvoided() { return duplicate_loads_avoided_; }
 
   private:
-    std::string MakeCanonical(const std::string& module_path);
+    enum CfgFile {
+        kCfgAlias,
+        kCfgDep,
+        kCfgSoftdep,
+        kCfgLoad,
+        kCfgOptions,
+        kCfgBlocklist,
+        kCfgBuiltin,
+        kNumCfgFiles,
+    };
+
+    std::string MakeCanonical(std::string_view module_path);
     bool InsmodWithDeps(const std::string& module_name, const std::string& parameters);
     bool Insmod(const std::string& path_name, const std::string& parameters);
     bool Rmmod(const std::string& module_name);
+    bool GetLoadedModules(std::unordered_map<std::string, LoadedModule>* loaded);
     std::vector<std::string> GetDependencies(const std::string& module);
     bool ModuleExists(const std::string& module_name);
-    void AddOption(const std::string& module_name, const std::string& option_name,
-                   const std::string& value);
     std::string GetKernelCmdline();
     bool IsBlocklisted(const std::string& module_name);
+    bool IsBuiltin(const std::string& canonical_name);
+    bool IsLoadSequential(const std::string& canonical_name);
+    void BuildBlocklistIndex();
+    void BuildDependencyClosures();
+    const ModuleBitset& GetClosure(int id);
+    void BuildModuleIndex();
+    int GetModuleId(const std::string& canonical_name);
+    bool IsLoaded(const std::string& canonical_name);
+    void SetModuleState(int id, ModuleState state);
+    ModuleState WaitForModule(int id);
+    int TakeModuleFd(int id, const std::string& path_name);
+    void ReturnModuleFd(int id, int fd);
+    int GetBaseFd(const std::string& canonical_name);
+    void CloseModuleFd(int id);
 
-    bool ParseDepCallback(const std::string& base_path, const std::vector<std::string>& args);
-    bool ParseAliasCallback(const std::vector<std::string>& args);
-    bool ParseSoftdepCallback(const std::vector<std::string>& args);
-    bool ParseLoadCallback(const std::vector<std::string>& args);
-    bool ParseOptionsCallback(const std::vector<std::string>& args);
-    bool ParseBlocklistCallback(const std::vector<std::string>& args);
+    bool ParseDepCallback(int base_index, TokenCursor& args);
+    bool ParseAliasCallback(TokenCursor& args);
+    bool ParseSoftdepCallback(TokenCursor& args);
+    bool ParseLoadCallback(TokenCursor& args);
+    bool ParseOptionsCallback(TokenCursor& args);
+    bool ParseBlocklistCallback(TokenCursor& args);
+    bool ParseBuiltinCallback(TokenCursor& args);
     void ParseKernelCmdlineOptions();
-    void ParseCfg(const std::string& cfg, std::function<bool(const std::vector<std::string>&)> f);
+    std::string CfgFileName(CfgFile file);
+    std::string CfgSourceName(int base_index, CfgFile file);
+    void ParseCfgFile(int base_index, CfgFile file);
+    bool ParseCfgIndex(int base_index, CfgFile file, const std::string& name);
+    std::vector<std::string> FindAliases(const std::string& name);
+    template <typename Handler>
+    void ParseCfg(int base_index, const std::string& cfg, Handler&& f);
 
+    // Module paths in module_deps_ are relative to the base directory they
+    // were parsed from and are only ever opened with openat() against it.
+    std::string load_file_;
+    std::vector<std::string> base_paths_;
+    std::vector<int> base_fds_;
+    std::unordered_map<std::string, int> module_base_;
     std::vector<std::pair<std::string, std::string>> module_aliases_;
+    // Per base path, its modules.alias.bin if aliases come from there.
+    std::vector<KmodIndex> alias_indexes_;
+    std::once_flag aliases_once_;
     std::unordered_map<std::string, std::vector<std::string>> module_deps_;
     std::vector<std::pair<std::string, std::string>> module_pre_softdep_;
     std::vector<std::pair<std::string, std::string>> module_post_softdep_;
     std::vector<std::string> module_load_;
     std::unordered_map<std::string, std::string> module_options_;
-    std::set<std::string> module_blocklist_;
-    std::mutex module_loaded_lock_;
-    std::unordered_set<std::string> module_loaded_;
-    std::unordered_set<std::string> module_loaded_paths_;
-    int module_count_ = 0;
+    std::unordered_set<std::string> module_blocklist_;
+    BloomFilter module_blocklist_filter_;
+    // The module or one of its hard deps is blocklisted.
+    ModuleBitset module_blocked_;
+    // Modules compiled into the kernel. They get IDs in the module index
+    // like any other module, with their state kLoaded from the start.
+    std::unordered_set<std::string> module_builtin_;
+    // Every module in module_deps_ gets a stable ID once parsing is done, the
+    // load state of each ID is then tracked without any lock.
+    std::unordered_map<std::string, int> module_ids_;
+    std::vector<const std::string*> module_names_;
+    // Per ID, the IDs of the hard deps on its modules.dep line.
+    std::vector<std::vector<int>> module_dep_ids_;
+    // Per ID, everything it needs loaded first, transitively. Filled for the
+    // modules in module_load_ and their deps only.
+    std::vector<ModuleBitset> module_closure_;
+    std::unique_ptr<std::atomic<ModuleState>[]> module_state_;
+    std::atomic<int> module_count_ = 0;
+    // Requesters of a module another worker is loading sleep here until it
+    // leaves kLoading instead of issuing a second finit_module.
+    std::mutex load_wait_lock_;
+    std::condition_variable load_wait_cv_;
+    std::atomic<int> load_waiters_ = 0;
+    std::atomic<int> duplicate_loads_avoided_ = 0;
+    // Module files are opened once by ID: the existence check fstat()s the
+    // fd and hands it back for Insmod to pass to finit_module. Whoever took
+    // an fd out owns it until it is returned.
+    std::unique_ptr<std::atomic<int>[]> module_fds_;
     bool blocklist_enabled = false;
+    WorkerConfig worker_config_;
+    int simulated_load_us_ = 0;
+    bool adaptive_load_ = false;
+    // Set for the duration of an adaptive parallel load.
+    std::unique_ptr<LoadLimiter> load_limiter_;
 };
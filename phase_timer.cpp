@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2024 Bardia Moshiri <fakeshell@bardia.tech>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "phase_timer.h"
+#include "modprobe.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+PhaseTimer& PhaseTimer::Get() {
+    static PhaseTimer timer;
+    return timer;
+}
+
+void PhaseTimer::Record(std::string name, Clock::duration duration) {
+    if (!enabled_) return;
+    std::lock_guard guard(lock_);
+    phases_.emplace_back(std::move(name), duration);
+}
+
+void PhaseTimer::Sample(std::string_view series, int value) {
+    if (!enabled_) return;
+    auto at = Clock::now() - start_;
+    std::lock_guard guard(lock_);
+    auto it = std::find_if(series_.begin(), series_.end(),
+                           [&](const auto& entry) { return entry.first == series; });
+    if (it == series_.end()) {
+        it = series_.emplace(series_.end(), std::string(series), std::vector<std::pair<Clock::duration, int>>());
+    }
+    it->second.emplace_back(at, value);
+}
+
+static double ToMs(PhaseTimer::Clock::duration duration) {
+    return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+std::string PhaseTimer::Summary() {
+    std::lock_guard guard(lock_);
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(3) << "timings:";
+    for (const auto& [name, duration] : phases_) {
+        oss << " " << name << "=" << ToMs(duration) << "ms";
+    }
+    for (const auto& [name, samples] : series_) {
+        oss << std::endl << name << ":";
+        for (const auto& [at, value] : samples) {
+            oss << " " << value << "@" << ToMs(at) << "ms";
+        }
+    }
+    return oss.str();
+}
+
+std::string PhaseTimer::Json() {
+    std::lock_guard guard(lock_);
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(3) << "{\"phases\":[";
+    for (auto it = phases_.begin(); it != phases_.end(); ++it) {
+        if (it != phases_.begin()) oss << ",";
+        oss << "{\"name\":\"" << JsonEscape(it->first) << "\",\"ms\":" << ToMs(it->second) << "}";
+    }
+    oss << "],\"series\":{";
+    for (auto it = series_.begin(); it != series_.end(); ++it) {
+        if (it != series_.begin()) oss << ",";
+        oss << "\"" << JsonEscape(it->first) << "\":[";
+        for (auto sample = it->second.begin(); sample != it->second.end(); ++sample) {
+            if (sample != it->second.begin()) oss << ",";
+            oss << "{\"ms\":" << ToMs(sample->first) << ",\"value\":" << sample->second << "}";
+        }
+        oss << "]";
+    }
+    oss << "}}";
+    return oss.str();
+}
+
+PhaseTimer::Scope::Scope(std::string_view name, std::string_view detail) {
+    if (!PhaseTimer::Get().Enabled()) return;
+    name_.reserve(name.size() + detail.size());
+    name_.append(name).append(detail);
+    start_ = Clock::now();
+}
+
+PhaseTimer::Scope::~Scope() {
+    if (name_.empty()) return;
+    PhaseTimer::Get().Record(std::move(name_), Clock::now() - start_);
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2024 Bardia Moshiri <fakeshell@bardia.tech>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Process wide record of how long each startup phase took. Recording is a
+// no-op until Enable() is called, so the timer costs nothing on normal boots.
+class PhaseTimer {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    static PhaseTimer& Get();
+
+    void Enable() { enabled_ = true; }
+    bool Enabled() const { return enabled_; }
+    void Record(std::string name, Clock::duration duration);
+    // Appends value to the named time series, stamped with the time since
+    // the timer was created.
+    void Sample(std::string_view series, int value);
+
+    // Single "timings: phase=1.234ms ..." line, followed by one
+    // "<series>: value@1.234ms ..." line per time series.
+    std::string Summary();
+    std::string Json();
+
+    // Records the lifetime of the scope as phase "<name><detail>".
+    class Scope {
+      public:
+        Scope(std::string_view name, std::string_view detail = "");
+        ~Scope();
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+      private:
+        std::string name_;
+        Clock::time_point start_;
+    };
+
+  private:
+    bool enabled_ = false;
+    std::mutex lock_;
+    Clock::time_point start_ = Clock::now();
+    std::vector<std::pair<std::string, Clock::duration>> phases_;
+    std::vector<std::pair<std::string, std::vector<std::pair<Clock::duration, int>>>> series_;
+};
@@ -0,0 +1,69 @@
+#!/bin/sh
+#
+# Generate a synthetic module tree for profiling and benchmarking.
+#
+# usage: gen-module-tree.sh OUTPUT_DIR [MODULES] [ALIASES_PER_MODULE] [SEED]
+#
+# The tree has the same layout as /lib/modules/<release>: modules.dep with
+# a random dependency DAG, modules.alias, modules.softdep, modules.options
+# and modules.load listing half of the modules. Module files are small
+# placeholders, finit_module() rejects them without touching kernel state.
+
+set -e
+
+out="${1:?usage: $0 OUTPUT_DIR [MODULES] [ALIASES_PER_MODULE] [SEED]}"
+modules="${2:-2000}"
+aliases="${3:-8}"
+seed="${4:-1}"
+
+mkdir -p "${out}/kernel/drivers/synth"
+
+awk -v out="${out}" -v n="${modules}" -v aliases="${aliases}" -v seed="${seed}" '
+function visit(i,    k, d) {
+    for (k = 1; k <= ndeps[i]; k++) {
+        d = dep[i, k]
+        if (d in seen) continue
+        seen[d] = 1
+        line = line " kernel/drivers/synth/mod" d ".ko"
+        visit(d)
+    }
+}
+BEGIN {
+    srand(seed)
+    # Like real trees, a tenth of the modules are library modules with
+    # shallow dependency chains and the rest are drivers using up to three
+    # of them.
+    libs = int(n / 10) > 0 ? int(n / 10) : 1
+    for (i = 0; i < n; i++) {
+        ndeps[i] = 0
+        if (i == 0) continue
+        if (i < libs) {
+            count = rand() < 0.3 ? 1 : 0
+        } else {
+            count = int(rand() * 4)
+        }
+        for (k = 0; k < count; k++) {
+            ndeps[i]++
+            dep[i, ndeps[i]] = int(rand() * (i < libs ? i : libs))
+        }
+    }
+    for (i = 0; i < n; i++) {
+        path = "kernel/drivers/synth/mod" i ".ko"
+        printf "synthetic module %d\n", i > (out "/" path)
+        close(out "/" path)
+        delete seen
+        line = path ":"
+        visit(i)
+        print line > (out "/modules.dep")
+        for (k = 0; k < aliases; k++) {
+            printf "alias synth:v%08Xd%04X* mod%d\n", i, k, i > (out "/modules.alias")
+        }
+        if (rand() < 0.5) print "mod" i ".ko" > (out "/modules.load")
+        if (rand() < 0.02 && i > 1) {
+            printf "softdep mod%d pre: mod%d post: mod%d\n", i, i - 1, i - 2 > (out "/modules.softdep")
+        }
+        if (rand() < 0.01) print "options mod" i " synth_param=" i > (out "/modules.options")
+    }
+}'
+
+touch "${out}/modules.softdep" "${out}/modules.options" "${out}/modules.blocklist"
@@ -0,0 +1,34 @@
+#!/bin/sh
+#
+# Report binary size and startup time of parse-modules-load build variants.
+#
+# usage: variant-report.sh MODULE_BASE_DIR BINARY...
+#
+# MODULE_BASE_DIR holds a tree for the running kernel, as /lib/modules does.
+# Each binary is run RUNS times (default 20) with --plan, which takes the
+# release-specific path of a boot up to the point of loading modules, and
+# the mean wall time of a run is printed next to its size in bytes.
+
+set -e
+
+base_dir="${1:?usage: $0 MODULE_BASE_DIR BINARY...}"
+shift
+runs="${RUNS:-20}"
+
+if [ ! -f "${base_dir}/$(uname -r)/modules.dep" ]; then
+    echo "$0: no modules.dep in ${base_dir}/$(uname -r)" >&2
+    exit 1
+fi
+
+printf "%-28s %12s %12s\n" "variant" "size" "startup_us"
+for binary in "$@"; do
+    size=$(stat -c %s "${binary}")
+    start=$(date +%s%N)
+    i=0
+    while [ "${i}" -lt "${runs}" ]; do
+        "./${binary#./}" -d "${base_dir}" --plan=/dev/null 2> /dev/null
+        i=$((i + 1))
+    done
+    end=$(date +%s%N)
+    printf "%-28s %12s %12s\n" "${binary}" "${size}" $(((end - start) / runs / 1000))
+done